@@ -0,0 +1,73 @@
+#pragma once
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+// Timing and JSON helpers shared by the benchmarks
+
+typedef std::chrono::high_resolution_clock Clock;
+
+// Marks a measurement the backend or machine could not take; written as null
+static const double none = std::nan("");
+
+static double seconds_since(Clock::time_point start) {
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Median seconds of one run of fn over the repetitions, after one warm-up run
+static double median_seconds(int repetitions, std::function<void()> fn) {
+	fn();
+	std::vector<double> times;
+	for (int i = 0; i < repetitions; i++) {
+		auto start = Clock::now();
+		fn();
+		times.push_back(seconds_since(start));
+	}
+	std::sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+static std::string json_number(double value) {
+	if (std::isnan(value))
+		return "null";
+	std::ostringstream stream;
+	stream << std::setprecision(6) << value;
+	return stream.str();
+}
+
+static std::string json_string(const std::string& value) {
+	std::string escaped = "\"";
+	for (char c : value) {
+		if (c == '"' || c == '\\')
+			escaped += '\\';
+		if ((unsigned char)c >= 0x20)
+			escaped += c;
+	}
+	return escaped + "\"";
+}
+
+// Table cell with two decimals, "-" for missing values
+static std::string table_cell(double value) {
+	std::ostringstream stream;
+	if (std::isnan(value))
+		stream << "-";
+	else
+		stream << std::fixed << std::setprecision(2) << value;
+	return stream.str();
+}
+
+// Power-of-two sizes as "4 KB", "16 MB", ...
+static std::string size_cell(size_t bytes) {
+	const char* units[] = { "B", "KB", "MB", "GB", "TB" };
+	int unit = 0;
+	while (bytes >= 1024 && bytes % 1024 == 0 && unit < 4) {
+		bytes /= 1024;
+		unit++;
+	}
+	return std::to_string(bytes) + " " + units[unit];
+}
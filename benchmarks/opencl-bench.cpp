@@ -0,0 +1,332 @@
+// Microbenchmarks for CL_Util on the device it picks: transfer bandwidth (blocking,
+// non-blocking and mapped), kernel launch latency, set_kernel_arg overhead, program build
+// time (cold and cached) and device discovery time.
+//
+// Build from this directory, e.g.
+//     g++ -std=c++17 -O2 opencl-bench.cpp -lOpenCL -pthread -o opencl-bench
+// On a CPU-only Linux machine PoCL provides the device (Debian/Ubuntu: pocl-opencl-icd).
+// Run with POCL_KERNEL_CACHE=0 so cold builds are really cold, or with
+// CL_UTIL_BACKEND=native to measure the native backend instead.
+//
+//     ./opencl-bench [--json file] [--min-size bytes] [--max-size bytes] [--repetitions n]
+//
+// Prints a table and writes the same numbers as JSON (opencl-bench.json by default) for
+// comparing runs. Every number is the median of the repetitions, after one warm-up.
+#ifndef CL_TARGET_OPENCL_VERSION
+#define CL_TARGET_OPENCL_VERSION 300
+#endif
+#include <CL/cl.h>
+#include <cstring>
+#include <filesystem>
+#include "../opencl-util.h"
+#include "bench-util.h"
+
+static const char* kernel_source = R"(
+__kernel void bench_empty(__global int* data, const uint n) {
+#ifdef BENCH_NONCE
+	if (get_global_id(0) == BENCH_NONCE)
+		data[0] = n;
+#endif
+}
+)";
+
+// Discovery prints the chosen device every time; keeps that out of the table
+class Quiet_Cout {
+public:
+	Quiet_Cout() : saved(std::cout.rdbuf(sink.rdbuf())) {}
+	~Quiet_Cout() { std::cout.rdbuf(saved); }
+
+private:
+	std::ostringstream sink;
+	std::streambuf* saved;
+};
+
+struct Bandwidth {
+	size_t size = 0;
+
+	// GB/s, NaN when the backend has no such transfer
+	double write_blocking = none;
+	double read_blocking = none;
+	double write_nonblocking = none;
+	double read_nonblocking = none;
+	double write_mapped = none;
+	double read_mapped = none;
+};
+
+struct Results {
+	std::string backend;
+	std::string device;
+	int repetitions = 0;
+
+	double opencl_available_ms = none;
+	double hardware_info_ms = none;
+
+	std::vector<Bandwidth> bandwidth;
+
+	double launch_roundtrip_us = none;
+	double launch_throughput_us = none;
+
+	double set_kernel_arg_buffer_ns = none;
+	double set_kernel_arg_value_ns = none;
+
+	double build_cold_ms = none;
+	double build_cached_us = none;
+};
+
+class OpenCL_Bench {
+public:
+	OpenCL_Bench(CL_Util& util, int repetitions) : util(util), repetitions(repetitions) {
+
+	}
+
+	void measure_discovery(Results& results) {
+		if (!CL_Hardware_Info::opencl_available())
+			return;
+		results.opencl_available_ms = 1e3 * median_seconds(repetitions, [] {
+			CL_Hardware_Info::opencl_available();
+		});
+		results.hardware_info_ms = 1e3 * median_seconds(repetitions, [] {
+			Quiet_Cout quiet;
+			CL_Hardware_Info hardware_info(std::vector<std::string>{});
+		});
+	}
+
+	// Transfers of each size are repeated enough to move about 64MB per timed run, so
+	// small sizes are not lost in timer resolution
+	void measure_bandwidth(Results& results, size_t min_size, size_t max_size) {
+		for (size_t size = min_size; size <= max_size; size *= 4) {
+			CL_Buffer buffer = util.try_create_buffer(size, CL_MEM_READ_WRITE, "bench");
+			if (!buffer.buffer) {
+				std::cout << "Skipping " << convertToGoodNumber((double)size) << " and larger: no room on the device" << "\n";
+				break;
+			}
+			std::vector<char> host(size, 1);
+			int iterations = (int)std::min(std::max((size_t)(64 << 20) / size, (size_t)1), (size_t)1000);
+
+			Bandwidth bandwidth;
+			bandwidth.size = size;
+			bandwidth.write_blocking = _gbps(size * iterations, [&] {
+				for (int i = 0; i < iterations; i++)
+					util.write_to_buffer(buffer, host.data());
+			});
+			bandwidth.read_blocking = _gbps(size * iterations, [&] {
+				for (int i = 0; i < iterations; i++)
+					util.read_from_buffer(host.data(), buffer);
+			});
+
+			if (!util.is_native()) {
+				cl_command_queue queue = util.get_queue();
+				bandwidth.write_nonblocking = _gbps(size * iterations, [&] {
+					for (int i = 0; i < iterations; i++)
+						clEnqueueWriteBuffer(queue, buffer.buffer, CL_FALSE, 0, size, host.data(), 0, nullptr, nullptr);
+					clFinish(queue);
+				});
+				bandwidth.read_nonblocking = _gbps(size * iterations, [&] {
+					for (int i = 0; i < iterations; i++)
+						clEnqueueReadBuffer(queue, buffer.buffer, CL_FALSE, 0, size, host.data(), 0, nullptr, nullptr);
+					clFinish(queue);
+				});
+
+				// Host-allocated memory is what mapping is meant for
+				CL_Buffer mapped = util.try_create_buffer(size, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, "bench");
+				if (mapped.buffer) {
+					bandwidth.write_mapped = _gbps(size * iterations, [&] {
+						for (int i = 0; i < iterations; i++)
+							_copy_mapped(mapped, host.data(), CL_MAP_WRITE_INVALIDATE_REGION);
+						clFinish(queue);
+					});
+					bandwidth.read_mapped = _gbps(size * iterations, [&] {
+						for (int i = 0; i < iterations; i++)
+							_copy_mapped(mapped, host.data(), CL_MAP_READ);
+						clFinish(queue);
+					});
+					util.release_buffer(mapped);
+				}
+			}
+
+			util.release_buffer(buffer);
+			results.bandwidth.push_back(bandwidth);
+		}
+	}
+
+	// Round trip is one launch waited for; throughput is the cost per launch when many are
+	// queued before waiting
+	void measure_launch(Results& results) {
+		CL_Buffer buffer = util.create_buffer(sizeof(cl_int), CL_MEM_READ_WRITE, "bench");
+		_use_empty_kernel();
+		util.set_kernel_arg(0, buffer);
+		util.set_kernel_arg_value(1, (cl_uint)0);
+
+		results.launch_roundtrip_us = 1e6 * median_seconds(repetitions, [&] {
+			for (int i = 0; i < 100; i++) {
+				util.run_kernel(1, 1);
+				util.finish_queue();
+			}
+		}) / 100;
+		results.launch_throughput_us = 1e6 * median_seconds(repetitions, [&] {
+			for (int i = 0; i < 1000; i++)
+				util.run_kernel(1, 1);
+			util.finish_queue();
+		}) / 1000;
+
+		const int calls = 100000;
+		results.set_kernel_arg_buffer_ns = 1e9 * median_seconds(repetitions, [&] {
+			for (int i = 0; i < calls; i++)
+				util.set_kernel_arg(0, buffer);
+		}) / calls;
+		results.set_kernel_arg_value_ns = 1e9 * median_seconds(repetitions, [&] {
+			for (int i = 0; i < calls; i++)
+				util.set_kernel_arg_value(1, (cl_uint)i);
+		}) / calls;
+
+		util.release_buffer(buffer);
+	}
+
+	// Cold builds define a fresh BENCH_NONCE so neither CL_Util nor the driver has the
+	// program cached; cached builds repeat the last options
+	void measure_build(Results& results) {
+		if (util.is_native())
+			return;
+		int nonce = 0;
+		std::vector<double> cold;
+		for (int i = 0; i < repetitions; i++) {
+			auto start = Clock::now();
+			util.get_program_variant(kernel_source, CL_Build_Options().define("BENCH_NONCE", nonce++));
+			cold.push_back(seconds_since(start));
+		}
+		std::sort(cold.begin(), cold.end());
+		results.build_cold_ms = 1e3 * cold[cold.size() / 2];
+
+		CL_Build_Options cached = CL_Build_Options().define("BENCH_NONCE", nonce - 1);
+		results.build_cached_us = 1e6 * median_seconds(repetitions, [&] {
+			for (int i = 0; i < 1000; i++)
+				util.get_program_variant(kernel_source, cached);
+		}) / 1000;
+	}
+
+private:
+	CL_Util& util;
+	int repetitions;
+
+	double _gbps(size_t bytes, std::function<void()> fn) {
+		return (double)bytes / median_seconds(repetitions, fn) / 1e9;
+	}
+
+	void _copy_mapped(CL_Buffer buffer, char* host, cl_map_flags flags) {
+		cl_int err;
+		void* mapped = clEnqueueMapBuffer(util.get_queue(), buffer.buffer, CL_TRUE, flags, 0, buffer.size, 0, nullptr, nullptr, &err);
+		assert_cl_success(err, "Error mapping buffer");
+		if (flags == CL_MAP_READ)
+			memcpy(host, mapped, buffer.size);
+		else
+			memcpy(mapped, host, buffer.size);
+		err = clEnqueueUnmapMemObject(util.get_queue(), buffer.buffer, mapped, 0, nullptr, nullptr);
+		assert_cl_success(err, "Error unmapping buffer");
+	}
+
+	void _use_empty_kernel() {
+		if (util.is_native()) {
+			register_native_kernel("bench_empty", Native_Kernel([](const Native_Work_Item&, const Native_Kernel_Args&) {}));
+			util.create_kernel("bench_empty");
+			return;
+		}
+		std::string path = (std::filesystem::temp_directory_path() / "opencl-bench.cl").string();
+		std::ofstream(path) << kernel_source;
+		util.create_program_and_kernel(path.c_str(), "bench_empty");
+		std::filesystem::remove(path);
+	}
+};
+
+static void write_json(const Results& results, const std::string& path) {
+	std::ofstream out(path);
+	out << "{\n";
+	out << "\t\"backend\": " << json_string(results.backend) << ",\n";
+	out << "\t\"device\": " << json_string(results.device) << ",\n";
+	out << "\t\"repetitions\": " << results.repetitions << ",\n";
+	out << "\t\"discovery\": { \"opencl_available_ms\": " << json_number(results.opencl_available_ms)
+		<< ", \"hardware_info_ms\": " << json_number(results.hardware_info_ms) << " },\n";
+
+	out << "\t\"bandwidth_gbps\": [\n";
+	for (size_t i = 0; i < results.bandwidth.size(); i++) {
+		const Bandwidth& b = results.bandwidth[i];
+		out << "\t\t{ \"size\": " << b.size
+			<< ", \"write_blocking\": " << json_number(b.write_blocking)
+			<< ", \"read_blocking\": " << json_number(b.read_blocking)
+			<< ", \"write_nonblocking\": " << json_number(b.write_nonblocking)
+			<< ", \"read_nonblocking\": " << json_number(b.read_nonblocking)
+			<< ", \"write_mapped\": " << json_number(b.write_mapped)
+			<< ", \"read_mapped\": " << json_number(b.read_mapped) << " }"
+			<< (i + 1 < results.bandwidth.size() ? "," : "") << "\n";
+	}
+	out << "\t],\n";
+
+	out << "\t\"launch\": { \"roundtrip_us\": " << json_number(results.launch_roundtrip_us)
+		<< ", \"throughput_us\": " << json_number(results.launch_throughput_us) << " },\n";
+	out << "\t\"set_kernel_arg\": { \"buffer_ns\": " << json_number(results.set_kernel_arg_buffer_ns)
+		<< ", \"value_ns\": " << json_number(results.set_kernel_arg_value_ns) << " },\n";
+	out << "\t\"build\": { \"cold_ms\": " << json_number(results.build_cold_ms)
+		<< ", \"cached_us\": " << json_number(results.build_cached_us) << " }\n";
+	out << "}\n";
+}
+
+static void print_results(const Results& results) {
+	std::cout << "\nBackend: " << results.backend << ", device: " << results.device << "\n";
+	std::cout << "Discovery: opencl_available " << table_cell(results.opencl_available_ms) << " ms, CL_Hardware_Info " << table_cell(results.hardware_info_ms) << " ms\n\n";
+
+	std::cout << "Bandwidth (GB/s)\n";
+	std::cout << std::setw(12) << "size" << std::setw(10) << "write" << std::setw(10) << "read" << std::setw(12) << "write nb"
+		<< std::setw(12) << "read nb" << std::setw(12) << "write map" << std::setw(12) << "read map" << "\n";
+	for (const Bandwidth& b : results.bandwidth) {
+		std::cout << std::setw(12) << convertToGoodNumber((double)b.size) << std::setw(10) << table_cell(b.write_blocking) << std::setw(10) << table_cell(b.read_blocking)
+			<< std::setw(12) << table_cell(b.write_nonblocking) << std::setw(12) << table_cell(b.read_nonblocking)
+			<< std::setw(12) << table_cell(b.write_mapped) << std::setw(12) << table_cell(b.read_mapped) << "\n";
+	}
+
+	std::cout << "\nLaunch: " << table_cell(results.launch_roundtrip_us) << " us round trip, " << table_cell(results.launch_throughput_us) << " us each when queued\n";
+	std::cout << "set_kernel_arg: " << table_cell(results.set_kernel_arg_buffer_ns) << " ns buffer, " << table_cell(results.set_kernel_arg_value_ns) << " ns value\n";
+	std::cout << "Build: " << table_cell(results.build_cold_ms) << " ms cold, " << table_cell(results.build_cached_us) << " us cached\n";
+}
+
+int main(int argc, char** argv) {
+	std::string json_path = "opencl-bench.json";
+	size_t min_size = 4 << 10;
+	size_t max_size = 256 << 20;
+	int repetitions = 9;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			std::cout << "Missing value for " << arg << "\n";
+			return 1;
+		}
+		if (arg == "--json")
+			json_path = argv[++i];
+		else if (arg == "--min-size")
+			min_size = std::max((size_t)std::stoull(argv[++i]), (size_t)1);
+		else if (arg == "--max-size")
+			max_size = (size_t)std::stoull(argv[++i]);
+		else if (arg == "--repetitions")
+			repetitions = std::max(std::stoi(argv[++i]), 1);
+		else {
+			std::cout << "Unknown argument: " << arg << "\n";
+			return 1;
+		}
+	}
+
+	CL_Util util;
+	Results results;
+	results.backend = util.is_native() ? "native" : "opencl";
+	results.device = util.is_native() ? "Native CPU backend" : std::string(CL_Device(util.get_device_id()).find_attribute<char*>("Name"));
+	results.repetitions = repetitions;
+
+	OpenCL_Bench bench(util, repetitions);
+	bench.measure_discovery(results);
+	bench.measure_bandwidth(results, min_size, max_size);
+	bench.measure_launch(results);
+	bench.measure_build(results);
+
+	print_results(results);
+	write_json(results, json_path);
+	std::cout << "\nWrote " << json_path << "\n";
+	return 0;
+}
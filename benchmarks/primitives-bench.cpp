@@ -0,0 +1,337 @@
+// Correctness and throughput of CL_Primitives against the std:: equivalents: reduce
+// (sum, min, max, bounding box), inclusive and exclusive scan, radix sort with and without
+// values, histogram and compaction. Every device result is read back and compared with
+// the host result, and the program exits with 1 if any of them differ.
+//
+// Build from this directory, e.g.
+//     g++ -std=c++17 -O2 primitives-bench.cpp -lOpenCL -pthread -o primitives-bench
+// On a CPU-only Linux machine PoCL provides the device (Debian/Ubuntu: pocl-opencl-icd).
+// Run with CL_UTIL_BACKEND=native to check the native backend instead.
+//
+//     ./primitives-bench [--json file] [--min-count n] [--max-count n] [--repetitions n]
+//
+// Element counts grow by 16x from min to max and include one that is not a multiple of
+// any work-group size. Prints a table and writes the same numbers as JSON
+// (primitives-bench.json by default). Times are medians of the repetitions after one
+// warm-up; device times include no transfers.
+#ifndef CL_TARGET_OPENCL_VERSION
+#define CL_TARGET_OPENCL_VERSION 300
+#endif
+#include <CL/cl.h>
+#include <cstring>
+#include <random>
+#include "../opencl-util.h"
+#include "../opencl-primitives.h"
+#include "bench-util.h"
+
+struct Row {
+	std::string name;
+	size_t count = 0;
+	bool correct = false;
+	double device_ms = none;
+	double host_ms = none;
+
+	double device_elements_per_second() const { return (double)count / (device_ms / 1e3); }
+};
+
+class Primitives_Bench {
+public:
+	Primitives_Bench(CL_Util& util, int repetitions) : util(util), primitives(util), repetitions(repetitions) {
+
+	}
+
+	void measure(size_t count, std::vector<Row>& rows) {
+		std::mt19937 rng((unsigned int)count);
+		std::uniform_int_distribution<unsigned int> small(0, 99);
+		std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+		std::vector<unsigned int> uints(count), keys(count), values(count), flags(count);
+		std::vector<float> floats(count);
+		std::vector<Vec2> points(count);
+		for (size_t i = 0; i < count; i++) {
+			uints[i] = small(rng);
+			keys[i] = (unsigned int)rng();
+			values[i] = (unsigned int)i;
+			flags[i] = rng() % 3 == 0;
+			floats[i] = unit(rng);
+			points[i] = Vec2(unit(rng), unit(rng));
+		}
+
+		CL_Buffer uint_buffer = _upload(uints);
+		CL_Buffer float_buffer = _upload(floats);
+		CL_Buffer point_buffer = _upload(points);
+		CL_Buffer flag_buffer = _upload(flags);
+		CL_Buffer out_buffer = util.create_buffer(count * sizeof(cl_uint), CL_MEM_READ_WRITE, "bench");
+		CL_Buffer value_buffer = util.create_buffer(count * sizeof(cl_uint), CL_MEM_READ_WRITE, "bench");
+		const cl_uint num_bins = 100;
+		CL_Buffer bin_buffer = util.create_buffer(num_bins * sizeof(cl_uint), CL_MEM_READ_WRITE, "bench");
+
+		// Reductions. Values are small integers so the sum is exact in any order.
+		{
+			Row row = _row("reduce_sum<uint>", count);
+			unsigned int device = 0, host = 0;
+			row.device_ms = _ms([&] { device = primitives.reduce_sum<unsigned int>(uint_buffer, count); });
+			row.host_ms = _ms([&] { host = std::accumulate(uints.begin(), uints.end(), 0u); });
+			row.correct = device == host;
+			rows.push_back(row);
+		}
+		{
+			Row row = _row("reduce_min<float>", count);
+			float device = 0, host = 0;
+			row.device_ms = _ms([&] { device = primitives.reduce_min<float>(float_buffer, count); });
+			row.host_ms = _ms([&] { host = *std::min_element(floats.begin(), floats.end()); });
+			row.correct = device == host;
+			rows.push_back(row);
+		}
+		{
+			Row row = _row("reduce_max<float>", count);
+			float device = 0, host = 0;
+			row.device_ms = _ms([&] { device = primitives.reduce_max<float>(float_buffer, count); });
+			row.host_ms = _ms([&] { host = *std::max_element(floats.begin(), floats.end()); });
+			row.correct = device == host;
+			rows.push_back(row);
+		}
+		{
+			Row row = _row("reduce_bounding_box", count);
+			CL_Bounding_Box device;
+			float host[4];
+			row.device_ms = _ms([&] { device = primitives.reduce_bounding_box(point_buffer, count); });
+			row.host_ms = _ms([&] {
+				auto x = std::minmax_element(points.begin(), points.end(), [](const Vec2& a, const Vec2& b) { return a.x < b.x; });
+				auto y = std::minmax_element(points.begin(), points.end(), [](const Vec2& a, const Vec2& b) { return a.y < b.y; });
+				host[0] = x.first->x;
+				host[1] = y.first->y;
+				host[2] = x.second->x;
+				host[3] = y.second->y;
+			});
+			row.correct = device.min.x == host[0] && device.min.y == host[1] && device.max.x == host[2] && device.max.y == host[3];
+			rows.push_back(row);
+		}
+
+		// Scans
+		std::vector<unsigned int> expected(count), result(count);
+		for (bool inclusive : { true, false }) {
+			Row row = _row(inclusive ? "inclusive_scan<uint>" : "exclusive_scan<uint>", count);
+			row.device_ms = _ms([&] {
+				if (inclusive)
+					primitives.inclusive_scan<unsigned int>(uint_buffer, out_buffer, count);
+				else
+					primitives.exclusive_scan<unsigned int>(uint_buffer, out_buffer, count);
+			});
+			row.host_ms = _ms([&] {
+				if (inclusive)
+					std::inclusive_scan(uints.begin(), uints.end(), expected.begin());
+				else
+					std::exclusive_scan(uints.begin(), uints.end(), expected.begin(), 0u);
+			});
+			util.read_from_buffer(result.data(), out_buffer);
+			row.correct = result == expected;
+			rows.push_back(row);
+		}
+
+		// Sorts run in place, so every repetition starts from a fresh upload
+		{
+			Row row = _row("sort", count);
+			row.device_ms = _ms_with_setup([&] { util.write_to_buffer(out_buffer, keys.data()); }, [&] {
+				primitives.sort(out_buffer, count);
+			});
+			row.host_ms = _ms_with_setup([&] { expected = keys; }, [&] {
+				std::sort(expected.begin(), expected.end());
+			});
+			util.read_from_buffer(result.data(), out_buffer);
+			row.correct = result == expected;
+			rows.push_back(row);
+		}
+		{
+			Row row = _row("sort_by_key", count);
+			std::vector<unsigned int> order(count), result_values(count);
+			row.device_ms = _ms_with_setup([&] {
+				util.write_to_buffer(out_buffer, keys.data());
+				util.write_to_buffer(value_buffer, values.data());
+			}, [&] {
+				primitives.sort_by_key(out_buffer, value_buffer, count);
+			});
+			row.host_ms = _ms_with_setup([&] { order = values; }, [&] {
+				std::stable_sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) { return keys[a] < keys[b]; });
+			});
+			util.read_from_buffer(result.data(), out_buffer);
+			util.read_from_buffer(result_values.data(), value_buffer);
+			// Stable, so equal keys keep their original order
+			row.correct = result_values == order;
+			for (size_t i = 0; row.correct && i < count; i++)
+				row.correct = result[i] == keys[order[i]];
+			rows.push_back(row);
+		}
+
+		// Histograms
+		std::vector<unsigned int> device_bins(num_bins), host_bins(num_bins);
+		{
+			Row row = _row("histogram", count);
+			row.device_ms = _ms([&] { primitives.histogram(uint_buffer, count, bin_buffer, num_bins); });
+			row.host_ms = _ms([&] {
+				std::fill(host_bins.begin(), host_bins.end(), 0u);
+				for (unsigned int v : uints)
+					host_bins[v]++;
+			});
+			util.read_from_buffer(device_bins.data(), num_bins * sizeof(cl_uint), bin_buffer.buffer);
+			row.correct = device_bins == host_bins;
+			rows.push_back(row);
+		}
+		{
+			Row row = _row("histogram_range", count);
+			row.device_ms = _ms([&] { primitives.histogram_range(float_buffer, count, -1.0f, 1.0f, bin_buffer, num_bins); });
+			row.host_ms = _ms([&] {
+				std::fill(host_bins.begin(), host_bins.end(), 0u);
+				float scale = (float)num_bins / 2.0f;
+				for (float v : floats)
+					host_bins[std::min((unsigned int)((v + 1.0f) * scale), num_bins - 1)]++;
+			});
+			util.read_from_buffer(device_bins.data(), num_bins * sizeof(cl_uint), bin_buffer.buffer);
+			row.correct = device_bins == host_bins;
+			rows.push_back(row);
+		}
+
+		// Compaction
+		{
+			Row row = _row("compact<float>", count);
+			size_t device_count = 0;
+			std::vector<float> host_out(count), device_out(count);
+			size_t host_count = 0;
+			row.device_ms = _ms([&] { device_count = primitives.compact<float>(float_buffer, flag_buffer, count, out_buffer); });
+			row.host_ms = _ms([&] {
+				size_t i = 0;
+				host_count = std::copy_if(floats.begin(), floats.end(), host_out.begin(), [&](const float&) { return flags[i++] != 0; }) - host_out.begin();
+			});
+			util.read_from_buffer(device_out.data(), count * sizeof(float), out_buffer.buffer);
+			row.correct = device_count == host_count && std::equal(host_out.begin(), host_out.begin() + host_count, device_out.begin());
+			rows.push_back(row);
+		}
+
+		for (CL_Buffer buffer : { uint_buffer, float_buffer, point_buffer, flag_buffer, out_buffer, value_buffer, bin_buffer })
+			util.release_buffer(buffer);
+	}
+
+private:
+	CL_Util& util;
+	CL_Primitives primitives;
+	int repetitions;
+
+	Row _row(const std::string& name, size_t count) {
+		Row row;
+		row.name = name;
+		row.count = count;
+		return row;
+	}
+
+	template <typename T>
+	CL_Buffer _upload(std::vector<T>& data) {
+		CL_Buffer buffer = util.create_buffer(data.size() * sizeof(T), CL_MEM_READ_WRITE, "bench");
+		util.write_to_buffer(buffer, data.data());
+		return buffer;
+	}
+
+	double _ms(std::function<void()> fn) {
+		return 1e3 * median_seconds(repetitions, [&] {
+			fn();
+			util.finish_queue();
+		});
+	}
+
+	// Only fn is timed; setup runs before the warm-up and every repetition
+	double _ms_with_setup(std::function<void()> setup, std::function<void()> fn) {
+		std::vector<double> times;
+		for (int i = 0; i <= repetitions; i++) {
+			setup();
+			util.finish_queue();
+			auto start = Clock::now();
+			fn();
+			util.finish_queue();
+			if (i > 0)
+				times.push_back(seconds_since(start));
+		}
+		std::sort(times.begin(), times.end());
+		return 1e3 * times[times.size() / 2];
+	}
+};
+
+static void write_json(const std::string& backend, const std::string& device, int repetitions, const std::vector<Row>& rows, const std::string& path) {
+	std::ofstream out(path);
+	out << "{\n";
+	out << "\t\"backend\": " << json_string(backend) << ",\n";
+	out << "\t\"device\": " << json_string(device) << ",\n";
+	out << "\t\"repetitions\": " << repetitions << ",\n";
+	out << "\t\"results\": [\n";
+	for (size_t i = 0; i < rows.size(); i++) {
+		const Row& row = rows[i];
+		out << "\t\t{ \"name\": " << json_string(row.name)
+			<< ", \"count\": " << row.count
+			<< ", \"correct\": " << (row.correct ? "true" : "false")
+			<< ", \"device_ms\": " << json_number(row.device_ms)
+			<< ", \"host_ms\": " << json_number(row.host_ms)
+			<< ", \"device_elements_per_second\": " << json_number(row.device_elements_per_second()) << " }"
+			<< (i + 1 < rows.size() ? "," : "") << "\n";
+	}
+	out << "\t]\n";
+	out << "}\n";
+}
+
+static void print_rows(const std::vector<Row>& rows) {
+	std::cout << std::setw(22) << "primitive" << std::setw(12) << "count" << std::setw(9) << "check"
+		<< std::setw(12) << "device ms" << std::setw(12) << "std:: ms" << std::setw(12) << "speedup" << std::setw(12) << "Melem/s" << "\n";
+	for (const Row& row : rows) {
+		std::cout << std::setw(22) << row.name << std::setw(12) << row.count << std::setw(9) << (row.correct ? "ok" : "FAILED")
+			<< std::setw(12) << table_cell(row.device_ms) << std::setw(12) << table_cell(row.host_ms)
+			<< std::setw(12) << table_cell(row.host_ms / row.device_ms) << std::setw(12) << table_cell(row.device_elements_per_second() / 1e6) << "\n";
+	}
+}
+
+int main(int argc, char** argv) {
+	std::string json_path = "primitives-bench.json";
+	size_t min_count = 1000;
+	size_t max_count = 16 << 20;
+	int repetitions = 5;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			std::cout << "Missing value for " << arg << "\n";
+			return 1;
+		}
+		if (arg == "--json")
+			json_path = argv[++i];
+		else if (arg == "--min-count")
+			min_count = std::max((size_t)std::stoull(argv[++i]), (size_t)1);
+		else if (arg == "--max-count")
+			max_count = (size_t)std::stoull(argv[++i]);
+		else if (arg == "--repetitions")
+			repetitions = std::max(std::stoi(argv[++i]), 1);
+		else {
+			std::cout << "Unknown argument: " << arg << "\n";
+			return 1;
+		}
+	}
+
+	CL_Util util;
+	std::string backend = util.is_native() ? "native" : "opencl";
+	std::string device = util.is_native() ? "Native CPU backend" : std::string(CL_Device(util.get_device_id()).find_attribute<char*>("Name"));
+
+	Primitives_Bench bench(util, repetitions);
+	std::vector<Row> rows;
+	for (size_t count = min_count; count <= max_count; count *= 16)
+		bench.measure(count, rows);
+	// Ragged tail: not a multiple of any work-group or scan block size
+	bench.measure(max_count / 3 + 1, rows);
+
+	std::cout << "\nBackend: " << backend << ", device: " << device << "\n\n";
+	print_rows(rows);
+	write_json(backend, device, repetitions, rows, json_path);
+	std::cout << "\nWrote " << json_path << "\n";
+
+	for (const Row& row : rows) {
+		if (!row.correct) {
+			std::cout << "Some results differ from std::" << "\n";
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,434 @@
+// Benchmarks for the hot paths of random.h and vec2.h: per-call and bulk random numbers,
+// scalar Vec2 operations, AoS against SoA batches on arrays from L1 size to DRAM size, and
+// scaling over threads.
+//
+// Build from this directory, e.g.
+//     g++ -std=c++17 -O2 util-bench.cpp -pthread -o util-bench
+//
+//     ./util-bench [--json file] [--max-size bytes] [--repetitions n] [--max-threads n]
+//
+// Prints tables and writes the same numbers as JSON (util-bench.json by default) for
+// comparing runs before and after a change. Every number is the median of the
+// repetitions, after one warm-up.
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <thread>
+#include "../random.h"
+#include "../vec2.h"
+#include "../native-util.h"
+#include "bench-util.h"
+
+// Results are summed into this so the compiler cannot drop the work
+static volatile float sink;
+
+struct Row {
+	std::string name;
+	size_t size = 0;
+	int threads = 1;
+
+	double ns_per_op = none;
+	double elements_per_second = none;
+	double gb_per_second = none;
+	double speedup = none;
+};
+
+struct Results {
+	int repetitions = 0;
+	int hardware_threads = 0;
+
+	std::vector<Row> random;
+	std::vector<Row> vec2;
+	std::vector<Row> batch;
+	std::vector<Row> scaling;
+};
+
+// fn processes count elements of an array of size bytes, moving bytes bytes in total
+// (0 when not meaningful)
+static Row measure(std::string name, int repetitions, size_t size, size_t count, size_t bytes, std::function<void()> fn) {
+	double seconds = median_seconds(repetitions, fn);
+
+	Row row;
+	row.name = name;
+	row.size = size;
+	row.ns_per_op = 1e9 * seconds / (double)count;
+	row.elements_per_second = (double)count / seconds;
+	if (bytes)
+		row.gb_per_second = (double)bytes / seconds / 1e9;
+	return row;
+}
+
+static std::vector<Vec2> random_points(size_t count) {
+	std::mt19937 generator(1234);
+	std::uniform_real_distribution<float> distr(-100, 100);
+	std::vector<Vec2> points(count);
+	for (auto& point : points)
+		point.set(distr(generator), distr(generator));
+	return points;
+}
+
+// Same math as an SoA rewrite would use, on either layout: float sqrt and a select
+// instead of a branch, so the loops vectorize
+static inline void normalize_inline(float& x, float& y) {
+	float length = std::sqrt(x * x + y * y);
+	float scale = length > 0 ? 1.0f / length : 1.0f;
+	x *= scale;
+	y *= scale;
+}
+
+static void measure_random(Results& results, int repetitions) {
+	// Random seeds a new generator from std::random_device on every call
+	const size_t calls = 20000;
+	results.random.push_back(measure("Random::random()", repetitions, 0, calls, 0, [&] {
+		float sum = 0;
+		for (size_t i = 0; i < calls; i++)
+			sum += Random::random();
+		sink = sum;
+	}));
+	results.random.push_back(measure("Random::random(max)", repetitions, 0, calls, 0, [&] {
+		float sum = 0;
+		for (size_t i = 0; i < calls; i++)
+			sum += Random::random(10.0f);
+		sink = sum;
+	}));
+	results.random.push_back(measure("Random::random(min, max)", repetitions, 0, calls, 0, [&] {
+		float sum = 0;
+		for (size_t i = 0; i < calls; i++)
+			sum += Random::random(-10.0f, 10.0f);
+		sink = sum;
+	}));
+
+	// Bulk generation into an array, with Random and with one generator kept across calls
+	std::vector<float> values(1 << 22);
+	results.random.push_back(measure("bulk Random::random()", repetitions, calls * sizeof(float), calls, calls * sizeof(float), [&] {
+		for (size_t i = 0; i < calls; i++)
+			values[i] = Random::random();
+	}));
+	results.random.push_back(measure("bulk mt19937 reused", repetitions, values.size() * sizeof(float), values.size(), values.size() * sizeof(float), [&] {
+		static std::mt19937 generator(1234);
+		std::uniform_real_distribution<float> distr(0, 1);
+		for (auto& value : values)
+			value = distr(generator);
+	}));
+	results.random.push_back(measure("bulk minstd_rand reused", repetitions, values.size() * sizeof(float), values.size(), values.size() * sizeof(float), [&] {
+		static std::minstd_rand generator(1234);
+		std::uniform_real_distribution<float> distr(0, 1);
+		for (auto& value : values)
+			value = distr(generator);
+	}));
+}
+
+// One L1-resident array processed many times, so this is the cost of the operation itself
+static void measure_vec2(Results& results, int repetitions) {
+	std::vector<Vec2> points = random_points(1024);
+	const int passes = 1000;
+	const size_t count = points.size() * passes;
+	Vec2 target(3, 4);
+
+	auto add = [&](std::string name, std::function<void()> fn) {
+		results.vec2.push_back(measure(name, repetitions, 0, count, 0, fn));
+	};
+
+	add("normalize", [&] {
+		for (int pass = 0; pass < passes; pass++) {
+			for (auto& point : points)
+				point.normalize();
+		}
+		sink = points[0].x;
+	});
+	add("normalized", [&] {
+		float sum = 0;
+		for (int pass = 0; pass < passes; pass++) {
+			for (auto& point : points)
+				sum += point.normalized().x;
+		}
+		sink = sum;
+	});
+	// Angles vary per element, or sin and cos would be hoisted out of the loop
+	add("rotate", [&] {
+		for (int pass = 0; pass < passes; pass++) {
+			for (size_t i = 0; i < points.size(); i++)
+				points[i].rotate((float)(i & 63));
+		}
+		sink = points[0].x;
+	});
+	add("rotateRad", [&] {
+		for (int pass = 0; pass < passes; pass++) {
+			for (size_t i = 0; i < points.size(); i++)
+				points[i].rotateRad((float)(i & 63) * 0.01f);
+		}
+		sink = points[0].x;
+	});
+	add("dist", [&] {
+		float sum = 0;
+		for (int pass = 0; pass < passes; pass++) {
+			for (auto& point : points)
+				sum += point.dist(target);
+		}
+		sink = sum;
+	});
+	add("length", [&] {
+		float sum = 0;
+		for (int pass = 0; pass < passes; pass++) {
+			for (auto& point : points)
+				sum += point.length();
+		}
+		sink = sum;
+	});
+	add("truncate", [&] {
+		for (int pass = 0; pass < passes; pass++) {
+			for (auto& point : points)
+				point.truncate(2.0f);
+		}
+		sink = points[0].x;
+	});
+	add("dot", [&] {
+		float sum = 0;
+		for (int pass = 0; pass < passes; pass++) {
+			for (auto& point : points)
+				sum += Vec2::dot(point, target);
+		}
+		sink = sum;
+	});
+	add("cross", [&] {
+		float sum = 0;
+		for (int pass = 0; pass < passes; pass++) {
+			for (auto& point : points)
+				sum += Vec2::cross(point, target);
+		}
+		sink = sum;
+	});
+}
+
+// Each size is processed enough times to touch about 64MB per timed run. aos_vec2 calls
+// the Vec2 methods; aos and soa run the same inline math, so aos_vec2 against aos is the
+// cost of the methods and aos against soa the cost of the layout.
+static void measure_batch(Results& results, int repetitions, size_t max_size) {
+	Vec2 target(3, 4);
+	for (size_t bytes = 4 << 10; bytes <= max_size; bytes *= 4) {
+		size_t count = bytes / sizeof(Vec2);
+		int passes = (int)std::max((size_t)(64 << 20) / bytes, (size_t)1);
+		size_t total = count * passes;
+
+		{
+			std::vector<Vec2> points = random_points(count);
+			Row row = measure("normalize aos_vec2", repetitions, bytes, total, 2 * bytes * passes, [&] {
+				for (int pass = 0; pass < passes; pass++) {
+					for (auto& point : points)
+						point.normalize();
+				}
+				sink = points[0].x;
+			});
+			results.batch.push_back(row);
+
+			row = measure("normalize aos", repetitions, bytes, total, 2 * bytes * passes, [&] {
+				for (int pass = 0; pass < passes; pass++) {
+					Vec2* p = points.data();
+					for (size_t i = 0; i < count; i++)
+						normalize_inline(p[i].x, p[i].y);
+				}
+				sink = points[0].x;
+			});
+			results.batch.push_back(row);
+
+			row = measure("dist_sum aos_vec2", repetitions, bytes, total, bytes * passes, [&] {
+				float sum = 0;
+				for (int pass = 0; pass < passes; pass++) {
+					for (auto& point : points)
+						sum += point.dist(target);
+				}
+				sink = sum;
+			});
+			results.batch.push_back(row);
+
+			row = measure("dist_sum aos", repetitions, bytes, total, bytes * passes, [&] {
+				float sum = 0;
+				for (int pass = 0; pass < passes; pass++) {
+					const Vec2* p = points.data();
+					for (size_t i = 0; i < count; i++) {
+						float dx = target.x - p[i].x, dy = target.y - p[i].y;
+						sum += std::sqrt(dx * dx + dy * dy);
+					}
+				}
+				sink = sum;
+			});
+			results.batch.push_back(row);
+		}
+
+		{
+			std::vector<Vec2> points = random_points(count);
+			std::vector<float> xs(count), ys(count);
+			for (size_t i = 0; i < count; i++) {
+				xs[i] = points[i].x;
+				ys[i] = points[i].y;
+			}
+			points.clear();
+			points.shrink_to_fit();
+
+			Row row = measure("normalize soa", repetitions, bytes, total, 2 * bytes * passes, [&] {
+				for (int pass = 0; pass < passes; pass++) {
+					float* x = xs.data();
+					float* y = ys.data();
+					for (size_t i = 0; i < count; i++)
+						normalize_inline(x[i], y[i]);
+				}
+				sink = xs[0];
+			});
+			results.batch.push_back(row);
+
+			row = measure("dist_sum soa", repetitions, bytes, total, bytes * passes, [&] {
+				float sum = 0;
+				for (int pass = 0; pass < passes; pass++) {
+					const float* x = xs.data();
+					const float* y = ys.data();
+					for (size_t i = 0; i < count; i++) {
+						float dx = target.x - x[i], dy = target.y - y[i];
+						sum += std::sqrt(dx * dx + dy * dy);
+					}
+				}
+				sink = sum;
+			});
+			results.batch.push_back(row);
+		}
+	}
+}
+
+// The largest batch size on 1, 2, 4, ... threads: normalize soa is bound by memory
+// bandwidth, rotate aos_vec2 by the sin/cos in every call
+static void measure_scaling(Results& results, int repetitions, size_t bytes, int max_threads) {
+	size_t count = bytes / sizeof(Vec2);
+	std::vector<Vec2> points = random_points(count);
+	std::vector<float> xs(count), ys(count);
+	for (size_t i = 0; i < count; i++) {
+		xs[i] = points[i].x;
+		ys[i] = points[i].y;
+	}
+
+	std::vector<int> thread_counts;
+	for (int threads = 1; threads < max_threads; threads *= 2)
+		thread_counts.push_back(threads);
+	thread_counts.push_back(max_threads);
+
+	double normalize_base = none, rotate_base = none;
+	for (int threads : thread_counts) {
+		Native_Thread_Pool pool(threads);
+
+		Row row = measure("normalize soa", repetitions, bytes, count, 2 * bytes, [&] {
+			pool.parallel_for(count, 4096, [&](size_t begin, size_t end) {
+				float* x = xs.data();
+				float* y = ys.data();
+				for (size_t i = begin; i < end; i++)
+					normalize_inline(x[i], y[i]);
+			});
+			sink = xs[0];
+		});
+		row.threads = threads;
+		if (std::isnan(normalize_base))
+			normalize_base = row.elements_per_second;
+		row.speedup = row.elements_per_second / normalize_base;
+		results.scaling.push_back(row);
+
+		row = measure("rotate aos_vec2", repetitions, bytes, count, 2 * bytes, [&] {
+			pool.parallel_for(count, 4096, [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++)
+					points[i].rotate((float)(i & 63));
+			});
+			sink = points[0].x;
+		});
+		row.threads = threads;
+		if (std::isnan(rotate_base))
+			rotate_base = row.elements_per_second;
+		row.speedup = row.elements_per_second / rotate_base;
+		results.scaling.push_back(row);
+	}
+}
+
+static void write_rows(std::ofstream& out, const char* name, const std::vector<Row>& rows, bool last) {
+	out << "\t" << json_string(name) << ": [\n";
+	for (size_t i = 0; i < rows.size(); i++) {
+		const Row& row = rows[i];
+		out << "\t\t{ \"name\": " << json_string(row.name)
+			<< ", \"size\": " << row.size
+			<< ", \"threads\": " << row.threads
+			<< ", \"ns_per_op\": " << json_number(row.ns_per_op)
+			<< ", \"elements_per_second\": " << json_number(row.elements_per_second)
+			<< ", \"gb_per_second\": " << json_number(row.gb_per_second)
+			<< ", \"speedup\": " << json_number(row.speedup) << " }"
+			<< (i + 1 < rows.size() ? "," : "") << "\n";
+	}
+	out << "\t]" << (last ? "" : ",") << "\n";
+}
+
+static void write_json(const Results& results, const std::string& path) {
+	std::ofstream out(path);
+	out << "{\n";
+	out << "\t\"repetitions\": " << results.repetitions << ",\n";
+	out << "\t\"hardware_threads\": " << results.hardware_threads << ",\n";
+	write_rows(out, "random", results.random, false);
+	write_rows(out, "vec2", results.vec2, false);
+	write_rows(out, "batch", results.batch, false);
+	write_rows(out, "scaling", results.scaling, true);
+	out << "}\n";
+}
+
+static void print_rows(const char* title, const std::vector<Row>& rows) {
+	std::cout << "\n" << title << "\n";
+	std::cout << std::setw(28) << "name" << std::setw(12) << "size" << std::setw(9) << "threads"
+		<< std::setw(12) << "ns/op" << std::setw(14) << "M elem/s" << std::setw(10) << "GB/s" << std::setw(10) << "speedup" << "\n";
+	for (const Row& row : rows) {
+		std::string size = row.size ? size_cell(row.size) : "-";
+		std::cout << std::setw(28) << row.name << std::setw(12) << size << std::setw(9) << row.threads
+			<< std::setw(12) << table_cell(row.ns_per_op) << std::setw(14) << table_cell(row.elements_per_second / 1e6)
+			<< std::setw(10) << table_cell(row.gb_per_second) << std::setw(10) << table_cell(row.speedup) << "\n";
+	}
+}
+
+int main(int argc, char** argv) {
+	std::string json_path = "util-bench.json";
+	size_t max_size = 256 << 20;
+	int repetitions = 9;
+	int max_threads = std::max((int)std::thread::hardware_concurrency(), 1);
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			std::cout << "Missing value for " << arg << "\n";
+			return 1;
+		}
+		if (arg == "--json")
+			json_path = argv[++i];
+		else if (arg == "--max-size")
+			max_size = std::max((size_t)std::stoull(argv[++i]), (size_t)(4 << 10));
+		else if (arg == "--repetitions")
+			repetitions = std::max(std::stoi(argv[++i]), 1);
+		else if (arg == "--max-threads")
+			max_threads = std::max(std::stoi(argv[++i]), 1);
+		else {
+			std::cout << "Unknown argument: " << arg << "\n";
+			return 1;
+		}
+	}
+
+	Results results;
+	results.repetitions = repetitions;
+	results.hardware_threads = (int)std::thread::hardware_concurrency();
+
+	measure_random(results, repetitions);
+	measure_vec2(results, repetitions);
+	measure_batch(results, repetitions, max_size);
+
+	// The last size the batch sweep reached
+	size_t scaling_size = 4 << 10;
+	while (scaling_size * 4 <= max_size)
+		scaling_size *= 4;
+	measure_scaling(results, repetitions, scaling_size, max_threads);
+
+	print_rows("Random", results.random);
+	print_rows("Vec2 (L1-resident, per call)", results.vec2);
+	print_rows("Batches", results.batch);
+	print_rows("Thread scaling", results.scaling);
+
+	write_json(results, json_path);
+	std::cout << "\nWrote " << json_path << "\n";
+	return 0;
+}
@@ -0,0 +1,417 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <stdlib.h>
+
+// Native CPU execution of CL_Util kernels, used when no OpenCL device is available.
+// Work-groups are mapped to tasks on a work-stealing thread pool. Barriers inside a
+// work-group are not supported, since each work item runs to completion in turn.
+
+struct Native_Work_Item {
+	unsigned int work_dim;
+	size_t global_id[3];
+	size_t local_id[3];
+	size_t group_id[3];
+	size_t global_size[3];
+	size_t local_size[3];
+	size_t global_offset[3];
+
+	size_t get_global_id(unsigned int dim) const { return dim < work_dim ? global_id[dim] : 0; }
+	size_t get_local_id(unsigned int dim) const { return dim < work_dim ? local_id[dim] : 0; }
+	size_t get_group_id(unsigned int dim) const { return dim < work_dim ? group_id[dim] : 0; }
+	size_t get_global_size(unsigned int dim) const { return dim < work_dim ? global_size[dim] : 1; }
+	size_t get_local_size(unsigned int dim) const { return dim < work_dim ? local_size[dim] : 1; }
+	size_t get_num_groups(unsigned int dim) const { return dim < work_dim ? global_size[dim] / local_size[dim] : 1; }
+	size_t get_global_offset(unsigned int dim) const { return dim < work_dim ? global_offset[dim] : 0; }
+	unsigned int get_work_dim() const { return work_dim; }
+};
+
+class Native_Kernel_Args {
+public:
+	void set_buffer(int index, void* data) {
+		_get(index).data = data;
+	}
+
+	void set_value(int index, const void* value, size_t size) {
+		Arg& arg = _get(index);
+		arg.data = nullptr;
+		arg.value.assign((const unsigned char*)value, (const unsigned char*)value + size);
+	}
+
+	template <typename T>
+	T* buffer(int index) const {
+		return (T*)args[index].data;
+	}
+
+	template <typename T>
+	T value(int index) const {
+		T result;
+		memcpy(&result, args[index].value.data(), sizeof(T));
+		return result;
+	}
+
+	int size() const {
+		return (int)args.size();
+	}
+
+private:
+	struct Arg {
+		void* data = nullptr;
+		std::vector<unsigned char> value;
+	};
+
+	std::vector<Arg> args;
+
+	Arg& _get(int index) {
+		if (index >= (int)args.size())
+			args.resize(index + 1);
+		return args[index];
+	}
+};
+
+// Either called once per work item, or once per chunk of whole 1D work-groups with the
+// global id range [begin, end) so the body can be a plain loop the compiler vectorizes
+struct Native_Kernel {
+	std::function<void(const Native_Work_Item&, const Native_Kernel_Args&)> item_function;
+	std::function<void(size_t, size_t, const Native_Kernel_Args&)> range_function;
+
+	Native_Kernel() {}
+
+	Native_Kernel(std::function<void(const Native_Work_Item&, const Native_Kernel_Args&)> item_function) : item_function(item_function) {}
+
+	static Native_Kernel from_range(std::function<void(size_t, size_t, const Native_Kernel_Args&)> range_function) {
+		Native_Kernel kernel;
+		kernel.range_function = range_function;
+		return kernel;
+	}
+
+	bool valid() const {
+		return item_function || range_function;
+	}
+};
+
+// Kernels looked up by function name when a program is "built" on the native backend
+class Native_Kernel_Registry {
+public:
+	static void add(std::string function_name, Native_Kernel kernel) {
+		std::lock_guard<std::mutex> lock(_mutex());
+		_kernels()[function_name] = kernel;
+	}
+
+	static bool contains(std::string function_name) {
+		std::lock_guard<std::mutex> lock(_mutex());
+		return _kernels().find(function_name) != _kernels().end();
+	}
+
+	static Native_Kernel find(std::string function_name) {
+		std::lock_guard<std::mutex> lock(_mutex());
+		auto it = _kernels().find(function_name);
+		if (it == _kernels().end()) {
+			std::cout << "Error! No native kernel registered with the name: " << function_name << "\n";
+			exit(1);
+		}
+		return it->second;
+	}
+
+private:
+	static std::map<std::string, Native_Kernel>& _kernels() {
+		static std::map<std::string, Native_Kernel> kernels;
+		return kernels;
+	}
+
+	static std::mutex& _mutex() {
+		static std::mutex mutex;
+		return mutex;
+	}
+};
+
+inline void register_native_kernel(std::string function_name, Native_Kernel kernel) {
+	Native_Kernel_Registry::add(function_name, kernel);
+}
+
+// Each worker owns a deque of tasks. It pops its own newest task and steals the oldest
+// task of another worker when it runs out, so uneven work-groups balance themselves.
+// The submitting thread works on its own deque too. A parallel_for called from inside a
+// task of the same pool runs inline on the calling thread instead of waiting on the pool.
+class Native_Thread_Pool {
+public:
+	Native_Thread_Pool(int num_threads = (int)std::thread::hardware_concurrency()) {
+		if (num_threads < 1)
+			num_threads = 1;
+
+		// The caller takes the last queue, so one fewer thread is needed
+		for (int i = 0; i < num_threads; i++)
+			queues.push_back(std::unique_ptr<Worker_Queue>(new Worker_Queue()));
+		for (int i = 0; i < num_threads - 1; i++)
+			threads.push_back(std::thread(&Native_Thread_Pool::_worker_loop, this, i));
+	}
+
+	~Native_Thread_Pool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& thread : threads)
+			thread.join();
+	}
+
+	Native_Thread_Pool(const Native_Thread_Pool&) = delete;
+	Native_Thread_Pool& operator=(const Native_Thread_Pool&) = delete;
+
+	static Native_Thread_Pool& shared() {
+		static Native_Thread_Pool pool;
+		return pool;
+	}
+
+	int get_num_threads() {
+		return (int)queues.size();
+	}
+
+	// Calls task(begin, end) over [0, count) in chunks that are multiples of grain
+	void parallel_for(size_t count, size_t grain, const std::function<void(size_t, size_t)>& task) {
+		if (count == 0)
+			return;
+		if (grain == 0)
+			grain = 1;
+
+		// Nested call from one of this pool's tasks: the pool is busy with the outer loop
+		if (_current_pool() == this) {
+			task(0, count);
+			return;
+		}
+
+		std::lock_guard<std::mutex> submit_lock(submit_mutex);
+		Current_Pool_Scope scope(this);
+
+		// About four chunks per thread so stealing can even out the load
+		size_t num_grains = (count + grain - 1) / grain;
+		size_t target_chunks = (size_t)get_num_threads() * 4;
+		size_t grains_per_chunk = std::max((size_t)1, num_grains / target_chunks);
+		size_t chunk_size = grains_per_chunk * grain;
+		size_t num_chunks = (count + chunk_size - 1) / chunk_size;
+
+		if (num_chunks == 1 || get_num_threads() == 1) {
+			task(0, count);
+			return;
+		}
+
+		remaining = num_chunks;
+		for (size_t i = 0; i < num_chunks; i++) {
+			Task t{ &task, i * chunk_size, std::min(count, (i + 1) * chunk_size) };
+			Worker_Queue& queue = *queues[i * queues.size() / num_chunks];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.tasks.push_back(t);
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			generation++;
+		}
+		wake.notify_all();
+
+		_work((int)queues.size() - 1);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this] { return remaining.load() == 0; });
+	}
+
+private:
+	struct Task {
+		const std::function<void(size_t, size_t)>* function;
+		size_t begin;
+		size_t end;
+	};
+
+	struct Worker_Queue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	// Marks the calling thread as running tasks of a pool until the scope ends
+	struct Current_Pool_Scope {
+		const Native_Thread_Pool* previous;
+
+		Current_Pool_Scope(const Native_Thread_Pool* pool) : previous(_current_pool()) {
+			_current_pool() = pool;
+		}
+
+		~Current_Pool_Scope() {
+			_current_pool() = previous;
+		}
+	};
+
+	static const Native_Thread_Pool*& _current_pool() {
+		static thread_local const Native_Thread_Pool* pool = nullptr;
+		return pool;
+	}
+
+	std::vector<std::thread> threads;
+	std::vector<std::unique_ptr<Worker_Queue>> queues;
+
+	std::mutex submit_mutex;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	std::atomic<size_t> remaining{ 0 };
+	unsigned long long generation = 0;
+	bool stopping = false;
+
+	bool _pop(int index, Task& task) {
+		Worker_Queue& own = *queues[index];
+		{
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (!own.tasks.empty()) {
+				task = own.tasks.back();
+				own.tasks.pop_back();
+				return true;
+			}
+		}
+		for (int i = 1; i < (int)queues.size(); i++) {
+			Worker_Queue& victim = *queues[(index + i) % queues.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.tasks.empty()) {
+				task = victim.tasks.front();
+				victim.tasks.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void _work(int index) {
+		Task task;
+		while (_pop(index, task)) {
+			(*task.function)(task.begin, task.end);
+			if (--remaining == 0) {
+				std::lock_guard<std::mutex> lock(mutex);
+				done.notify_all();
+			}
+		}
+	}
+
+	void _worker_loop(int index) {
+		Current_Pool_Scope scope(this);
+		unsigned long long seen_generation = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&] { return stopping || generation != seen_generation; });
+				if (stopping)
+					return;
+				seen_generation = generation;
+			}
+			_work(index);
+		}
+	}
+};
+
+// Memory and thread pool of the native backend. Owned by one CL_Util, or shared by every
+// util attached to a native CL_Session; each util keeps its own kernel and arguments and
+// passes them to run.
+class Native_Device {
+public:
+	Native_Device(Native_Thread_Pool& pool = Native_Thread_Pool::shared()) : pool(pool) {}
+
+	Native_Thread_Pool& get_pool() { return pool; }
+
+	// Safe to call from several threads, e.g. utils sharing a session
+	void* allocate(size_t size) {
+		std::unique_ptr<unsigned char[]> data(new unsigned char[size > 0 ? size : 1]());
+		void* ptr = data.get();
+		std::lock_guard<std::mutex> lock(allocations_mutex);
+		allocations[ptr] = std::move(data);
+		return ptr;
+	}
+
+	void release(void* ptr) {
+		std::unique_ptr<unsigned char[]> data;
+		{
+			std::lock_guard<std::mutex> lock(allocations_mutex);
+			auto it = allocations.find(ptr);
+			if (it == allocations.end())
+				return;
+			data = std::move(it->second);
+			allocations.erase(it);
+		}
+	}
+
+	// Local size used when the caller leaves the choice to the backend
+	static std::vector<size_t> default_local_size(int work_dim) {
+		if (work_dim == 1)
+			return { 64 };
+		if (work_dim == 2)
+			return { 16, 8 };
+		return { 8, 4, 4 };
+	}
+
+	void run(const Native_Kernel& kernel, const Native_Kernel_Args& args, unsigned int work_dim, const size_t* global_size,
+		const size_t* local_size, const size_t* offset) {
+		if (!kernel.valid()) {
+			std::cout << "Error! No native kernel has been set" << "\n";
+			exit(1);
+		}
+
+		Native_Work_Item base;
+		base.work_dim = work_dim;
+		size_t num_groups[3] = { 1, 1, 1 };
+		for (unsigned int d = 0; d < 3; d++) {
+			base.global_size[d] = d < work_dim ? global_size[d] : 1;
+			base.local_size[d] = d < work_dim && local_size ? local_size[d] : 1;
+			base.global_offset[d] = d < work_dim && offset ? offset[d] : 0;
+			num_groups[d] = base.global_size[d] / base.local_size[d];
+		}
+
+		if (kernel.range_function) {
+			if (work_dim != 1) {
+				std::cout << "Error! Native range kernels only support 1D launches" << "\n";
+				exit(1);
+			}
+			size_t start = base.global_offset[0];
+			auto& range_function = kernel.range_function;
+			pool.parallel_for(base.global_size[0], base.local_size[0], [&](size_t begin, size_t end) {
+				range_function(start + begin, start + end, args);
+			});
+			return;
+		}
+
+		size_t total_groups = num_groups[0] * num_groups[1] * num_groups[2];
+		auto& item_function = kernel.item_function;
+		pool.parallel_for(total_groups, 1, [&](size_t begin, size_t end) {
+			Native_Work_Item item = base;
+			for (size_t group = begin; group < end; group++) {
+				item.group_id[0] = group % num_groups[0];
+				item.group_id[1] = (group / num_groups[0]) % num_groups[1];
+				item.group_id[2] = group / (num_groups[0] * num_groups[1]);
+
+				for (size_t z = 0; z < item.local_size[2]; z++) {
+					for (size_t y = 0; y < item.local_size[1]; y++) {
+						for (size_t x = 0; x < item.local_size[0]; x++) {
+							item.local_id[0] = x;
+							item.local_id[1] = y;
+							item.local_id[2] = z;
+							for (unsigned int d = 0; d < 3; d++)
+								item.global_id[d] = item.global_offset[d] + item.group_id[d] * item.local_size[d] + item.local_id[d];
+							item_function(item, args);
+						}
+					}
+				}
+			}
+		});
+	}
+
+private:
+	Native_Thread_Pool& pool;
+	std::map<void*, std::unique_ptr<unsigned char[]>> allocations;
+	std::mutex allocations_mutex;
+};
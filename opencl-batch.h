@@ -0,0 +1,358 @@
+#pragma once
+#include <cmath>
+#include "opencl-util.h"
+
+// Coalesces many small requests for the same kernel into one launch. Each request's
+// input is packed into one shared input buffer, the kernel runs once over all of them
+// and each request's slice of the shared output is copied back to it.
+//
+// The kernel gets the batch as its first five arguments, and any extra arguments set
+// with set_kernel_arg follow them:
+//     kernel void f(global const TIn* in, global TOut* out, global const uint4* segments,
+//                   uint num_segments, uint total, ...)
+// segments[i] = (input offset, input count, output offset, output count) of request i.
+// With ELEMENTS there is one work item per input element, padded up to the local size, so
+// skip ids >= total. With SEGMENTS there is one work-group per request.
+//
+// Flushing happens on the calling thread: explicitly with flush(), when a size limit is
+// reached in submit(), or when poll() or submit() finds the oldest request older than the
+// delay limit. Outputs are written once the flush that contains them returns.
+template <typename TIn, typename TOut>
+class CL_Batcher {
+public:
+	enum Launch { ELEMENTS, SEGMENTS };
+
+	CL_Batcher(CL_Util& util, const char* function_name, Launch launch = ELEMENTS, size_t local_size = 0)
+		: util(util), function_name(function_name), launch(launch), local_size(local_size) {
+		if (util.is_native()) {
+			native_kernel = Native_Kernel_Registry::find(function_name);
+			if (local_size == 0)
+				this->local_size = Native_Device::default_local_size(1)[0];
+		}
+		else {
+			cl_int err;
+			kernel = clCreateKernel(util.get_program(), function_name, &err);
+			assert_cl_success(err, "Error creating OpenCL kernel");
+			if (local_size == 0)
+				this->local_size = 64;
+		}
+
+		// The staging buffers are only needed during a flush, so they can go when memory runs short
+		trim_id = util.add_memory_trim_callback([this](size_t) {
+			return flushing ? 0 : _release_buffers();
+		});
+	}
+
+	~CL_Batcher() {
+		util.remove_memory_trim_callback(trim_id);
+		_release_buffers();
+		if (kernel)
+			clReleaseKernel(kernel);
+	}
+
+	CL_Batcher(const CL_Batcher&) = delete;
+	CL_Batcher& operator=(const CL_Batcher&) = delete;
+
+	// Flush once a batch reaches any of these; 0 turns a limit off
+	void set_flush_policy(size_t max_requests, size_t max_elements, double max_delay_ms) {
+		this->max_requests = max_requests;
+		this->max_elements = max_elements;
+		this->max_delay_ms = max_delay_ms;
+	}
+
+	// Extra kernel arguments after the five batch arguments
+	void set_kernel_arg(int index, cl_mem buffer) {
+		_set_arg(5 + index, sizeof(cl_mem), &buffer, (void*)buffer);
+	}
+
+	template <typename T>
+	void set_kernel_arg_value(int index, T value) {
+		_set_arg(5 + index, sizeof(T), &value, nullptr);
+	}
+
+	// The input is copied right away; output must stay valid until the flush
+	void submit(const TIn* input, size_t count, TOut* output, size_t output_count) {
+		if (pending.empty())
+			oldest = _now();
+
+		Request request;
+		request.input_offset = staged_input.size();
+		request.input_count = count;
+		request.output_offset = total_output;
+		request.output_count = output_count;
+		request.output = output;
+		request.submitted = _now();
+		pending.push_back(request);
+
+		staged_input.insert(staged_input.end(), input, input + count);
+		total_output += output_count;
+
+		if ((max_requests && pending.size() >= max_requests) || (max_elements && staged_input.size() >= max_elements))
+			flush();
+		else
+			poll();
+	}
+
+	// Same number of outputs as inputs
+	void submit(const TIn* input, size_t count, TOut* output) {
+		submit(input, count, output, count);
+	}
+
+	// Flushes if the oldest request has waited longer than the delay limit. Call this
+	// from the submitting loop when requests can stop arriving.
+	void poll() {
+		if (!pending.empty() && max_delay_ms > 0 && _ms(oldest, _now()) >= max_delay_ms)
+			flush();
+	}
+
+	void flush() {
+		if (pending.empty())
+			return;
+		auto start = _now();
+		flushing = true;
+
+		std::vector<cl_uint> segments;
+		segments.reserve(pending.size() * 4);
+		for (auto& request : pending) {
+			segments.push_back((cl_uint)request.input_offset);
+			segments.push_back((cl_uint)request.input_count);
+			segments.push_back((cl_uint)request.output_offset);
+			segments.push_back((cl_uint)request.output_count);
+		}
+
+		_reserve(input_buffer, input_capacity, staged_input.size() * sizeof(TIn), CL_MEM_READ_ONLY);
+		_reserve(output_buffer, output_capacity, total_output * sizeof(TOut), CL_MEM_WRITE_ONLY);
+		_reserve(segment_buffer, segment_capacity, segments.size() * sizeof(cl_uint), CL_MEM_READ_ONLY);
+
+		if (!staged_input.empty())
+			util.write_to_buffer(input_buffer, staged_input.size() * sizeof(TIn), staged_input.data());
+		util.write_to_buffer(segment_buffer, segments.size() * sizeof(cl_uint), segments.data());
+
+		cl_uint num_segments = (cl_uint)pending.size();
+		cl_uint total = (cl_uint)staged_input.size();
+		_set_arg(0, sizeof(cl_mem), &input_buffer, (void*)input_buffer);
+		_set_arg(1, sizeof(cl_mem), &output_buffer, (void*)output_buffer);
+		_set_arg(2, sizeof(cl_mem), &segment_buffer, (void*)segment_buffer);
+		_set_arg(3, sizeof(cl_uint), &num_segments, nullptr);
+		_set_arg(4, sizeof(cl_uint), &total, nullptr);
+
+		size_t global_size = launch == SEGMENTS ? pending.size() * local_size : ((total + local_size - 1) / local_size) * local_size;
+		if (global_size > 0)
+			_run(global_size);
+
+		staged_output.resize(total_output);
+		if (total_output > 0)
+			util.read_from_buffer(staged_output.data(), total_output * sizeof(TOut), output_buffer);
+
+		auto end = _now();
+		for (auto& request : pending) {
+			std::copy(staged_output.begin() + request.output_offset, staged_output.begin() + request.output_offset + request.output_count, request.output);
+			_add_latency(_ms(request.submitted, end));
+		}
+
+		num_batches++;
+		num_requests += pending.size();
+		num_elements += staged_input.size();
+		busy_seconds += std::chrono::duration<double>(end - start).count();
+		if (!stats_started) {
+			stats_start = pending.front().submitted;
+			stats_started = true;
+		}
+		stats_end = end;
+
+		pending.clear();
+		staged_input.clear();
+		total_output = 0;
+		flushing = false;
+	}
+
+	size_t get_num_pending() { return pending.size(); }
+
+	// Statistics since construction or reset_stats()
+
+	long long get_num_batches() { return num_batches; }
+	long long get_num_requests() { return num_requests; }
+	long long get_num_elements() { return num_elements; }
+
+	double get_average_batch_size() {
+		return num_batches ? (double)num_requests / (double)num_batches : 0;
+	}
+
+	// Milliseconds from submit until the request's output was written; percentile in [0, 100].
+	// Read from a fixed histogram, so it is within about 6% of the exact value.
+	double get_latency_ms(double percentile) {
+		if (num_latencies == 0)
+			return 0;
+		long long rank = std::min(num_latencies - 1, (long long)(percentile / 100.0 * (double)num_latencies));
+		if (rank == num_latencies - 1)
+			return max_latency_ms;
+		long long seen = 0;
+		for (int i = 0; i < num_latency_buckets; i++) {
+			seen += latency_counts[i];
+			if (seen > rank)
+				return std::min(_latency_bucket_middle(i), max_latency_ms);
+		}
+		return max_latency_ms;
+	}
+
+	double get_average_latency_ms() {
+		return num_latencies ? latency_sum_ms / (double)num_latencies : 0;
+	}
+
+	// Requests per second while flushing, and over the whole time since the first submit
+	double get_busy_throughput() {
+		return busy_seconds > 0 ? (double)num_requests / busy_seconds : 0;
+	}
+
+	double get_throughput() {
+		double seconds = stats_started ? std::chrono::duration<double>(stats_end - stats_start).count() : 0;
+		return seconds > 0 ? (double)num_requests / seconds : 0;
+	}
+
+	void print_stats() {
+		std::cout << "Batches: " << num_batches << ", requests: " << num_requests << " (" << get_average_batch_size() << " per batch)\n";
+		std::cout << "Latency: average " << get_average_latency_ms() << " ms, p50 " << get_latency_ms(50) << " ms, p99 " << get_latency_ms(99) << " ms\n";
+		std::cout << "Throughput: " << get_throughput() << " requests/s (" << get_busy_throughput() << " while flushing)\n";
+	}
+
+	void reset_stats() {
+		num_batches = 0;
+		num_requests = 0;
+		num_elements = 0;
+		busy_seconds = 0;
+		std::fill(std::begin(latency_counts), std::end(latency_counts), 0);
+		num_latencies = 0;
+		latency_sum_ms = 0;
+		max_latency_ms = 0;
+		stats_started = false;
+	}
+
+private:
+	typedef std::chrono::high_resolution_clock::time_point Time_Point;
+
+	struct Request {
+		size_t input_offset;
+		size_t input_count;
+		size_t output_offset;
+		size_t output_count;
+		TOut* output;
+		Time_Point submitted;
+	};
+
+	CL_Util& util;
+	std::string function_name;
+	Launch launch;
+	size_t local_size;
+
+	cl_kernel kernel = nullptr;
+	Native_Kernel native_kernel;
+	Native_Kernel_Args native_args;
+
+	size_t max_requests = 256;
+	size_t max_elements = 0;
+	double max_delay_ms = 1;
+
+	std::vector<Request> pending;
+	std::vector<TIn> staged_input;
+	std::vector<TOut> staged_output;
+	size_t total_output = 0;
+	Time_Point oldest;
+
+	cl_mem input_buffer = nullptr;
+	cl_mem output_buffer = nullptr;
+	cl_mem segment_buffer = nullptr;
+	size_t input_capacity = 0;
+	size_t output_capacity = 0;
+	size_t segment_capacity = 0;
+	bool flushing = false;
+	int trim_id = -1;
+
+	long long num_batches = 0;
+	long long num_requests = 0;
+	long long num_elements = 0;
+	double busy_seconds = 0;
+
+	// 20 log-spaced buckets per decade from 1 us to 1000 s, plus one below and one above
+	static const int latency_buckets_per_decade = 20;
+	static const int num_latency_buckets = 9 * latency_buckets_per_decade + 2;
+	static constexpr double min_latency_ms = 1e-3;
+	long long latency_counts[num_latency_buckets] = {};
+	long long num_latencies = 0;
+	double latency_sum_ms = 0;
+	double max_latency_ms = 0;
+
+	bool stats_started = false;
+	Time_Point stats_start;
+	Time_Point stats_end;
+
+	void _add_latency(double ms) {
+		int i = 0;
+		if (ms >= min_latency_ms)
+			i = std::min(num_latency_buckets - 1, 1 + (int)(std::log10(ms / min_latency_ms) * latency_buckets_per_decade));
+		latency_counts[i]++;
+		num_latencies++;
+		latency_sum_ms += ms;
+		max_latency_ms = std::max(max_latency_ms, ms);
+	}
+
+	// Geometric middle of bucket i
+	static double _latency_bucket_middle(int i) {
+		if (i == 0)
+			return min_latency_ms / 2;
+		return min_latency_ms * std::pow(10.0, (i - 0.5) / latency_buckets_per_decade);
+	}
+
+	static Time_Point _now() {
+		return std::chrono::high_resolution_clock::now();
+	}
+
+	static double _ms(Time_Point from, Time_Point to) {
+		return std::chrono::duration<double, std::milli>(to - from).count();
+	}
+
+	// Grows geometrically so steady traffic stops reallocating
+	void _reserve(cl_mem& buffer, size_t& capacity, size_t size, cl_mem_flags flags) {
+		if (size <= capacity && buffer)
+			return;
+		util.release_buffer(buffer);
+		capacity = std::max(size, capacity * 2);
+		buffer = util.create_raw_buffer(std::max(capacity, (size_t)1), flags, "CL_Batcher");
+	}
+
+	// Bytes freed
+	size_t _release_buffers() {
+		size_t freed = 0;
+		cl_mem* buffers[] = { &input_buffer, &output_buffer, &segment_buffer };
+		size_t* capacities[] = { &input_capacity, &output_capacity, &segment_capacity };
+		for (int i = 0; i < 3; i++) {
+			if (*buffers[i])
+				freed += std::max(*capacities[i], (size_t)1);
+			util.release_buffer(*buffers[i]);
+			*buffers[i] = nullptr;
+			*capacities[i] = 0;
+		}
+		return freed;
+	}
+
+	// Buffers on the native backend are host pointers
+	void _set_arg(int index, size_t size, const void* value, void* native_buffer) {
+		if (util.is_native()) {
+			if (native_buffer)
+				native_args.set_buffer(index, native_buffer);
+			else
+				native_args.set_value(index, value, size);
+			return;
+		}
+		cl_int err = clSetKernelArg(kernel, (cl_uint)index, size, value);
+		assert_cl_success(err, "Error setting OpenCL kernel arg");
+	}
+
+	void _run(size_t global_size) {
+		if (util.is_native()) {
+			util.get_native_device()->run(native_kernel, native_args, 1, &global_size, &local_size, nullptr);
+			return;
+		}
+		cl_int err = clEnqueueNDRangeKernel(util.get_queue(), kernel, 1, nullptr, &global_size, &local_size, 0, nullptr, nullptr);
+		assert_cl_success(err, "Error enqueuing OpenCL kernel");
+	}
+};
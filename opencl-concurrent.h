@@ -0,0 +1,310 @@
+#pragma once
+#include "opencl-util.h"
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+
+// Per-thread view of a CL_Concurrent_Util. It owns its own kernel objects, so argument
+// state never races with other threads, and submits to its own (or a pooled) queue.
+// Only use it from the thread that obtained it. It is freed when that thread exits.
+class CL_Submitter {
+public:
+	CL_Submitter(std::function<cl_kernel(const char*)> kernel_factory, cl_command_queue queue, bool owns_queue = false)
+		: kernel_factory(kernel_factory), queue(queue), owns_queue(owns_queue) {
+
+	}
+
+	~CL_Submitter() {
+		detach();
+	}
+
+	CL_Submitter(const CL_Submitter&) = delete;
+	CL_Submitter& operator=(const CL_Submitter&) = delete;
+
+	cl_command_queue get_queue() { return queue; }
+	cl_kernel get_kernel() { return kernel; }
+
+	// Releases the kernels and an owned queue, e.g. when the CL_Concurrent_Util goes away
+	// before the thread that used it
+	void detach() {
+		for (auto& entry : kernels)
+			clReleaseKernel(entry.second);
+		kernels.clear();
+		kernel = nullptr;
+		if (owns_queue && queue)
+			clReleaseCommandQueue(queue);
+		queue = nullptr;
+		kernel_factory = nullptr;
+	}
+
+	bool is_detached() { return !kernel_factory; }
+
+	// Selects the kernel used by the following set_kernel_arg/run_kernel calls,
+	// creating this thread's copy of it the first time
+	void use_kernel(const char* function_name) {
+		if (is_detached()) {
+			std::cout << "Error! The CL_Concurrent_Util of this CL_Submitter has been destroyed" << "\n";
+			exit(1);
+		}
+		auto it = kernels.find(function_name);
+		if (it == kernels.end())
+			it = kernels.emplace(function_name, kernel_factory(function_name)).first;
+		kernel = it->second;
+		current_kernel_arg = 0;
+	}
+
+	void set_kernel_arg(int index, cl_mem buffer) {
+		cl_int err = clSetKernelArg(kernel, (cl_uint)index, sizeof(cl_mem), &buffer);
+		assert_cl_success(err, "Error setting OpenCL kernel arg");
+	}
+
+	void set_kernel_arg(cl_mem buffer) {
+		set_kernel_arg(current_kernel_arg, buffer);
+		current_kernel_arg++;
+	}
+
+	void set_kernel_arg(int index, CL_Buffer buffer) {
+		set_kernel_arg(index, buffer.buffer);
+	}
+
+	void set_kernel_arg(CL_Buffer buffer) {
+		set_kernel_arg(buffer.buffer);
+	}
+
+	template <typename T>
+	void set_kernel_arg_value(int index, T value) {
+		cl_int err = clSetKernelArg(kernel, (cl_uint)index, sizeof(T), &value);
+		assert_cl_success(err, "Error setting OpenCL kernel arg");
+	}
+
+	template <typename T>
+	void set_kernel_arg_value(T value) {
+		set_kernel_arg_value(current_kernel_arg, value);
+		current_kernel_arg++;
+	}
+
+	template <typename T>
+	void write_to_buffer(CL_Buffer buffer, T* data, bool blocking = true) {
+		cl_int err = clEnqueueWriteBuffer(queue, buffer.buffer, blocking ? CL_TRUE : CL_FALSE, 0, buffer.size, data, 0, nullptr, nullptr);
+		assert_cl_success(err, "Error writing to buffer");
+	}
+
+	void read_from_buffer(void* data_ptr, CL_Buffer buffer, bool blocking = true) {
+		cl_int err = clEnqueueReadBuffer(queue, buffer.buffer, blocking ? CL_TRUE : CL_FALSE, 0, buffer.size, data_ptr, 0, nullptr, nullptr);
+		assert_cl_success(err, "Error reading from buffer");
+	}
+
+	void run_kernel(size_t global_size, size_t local_size) {
+		if (global_size <= 0 || local_size <= 0 || global_size % local_size != 0) {
+			std::cout << "Global item size must be divisible by local item size!" << "\n\n";
+			exit(1);
+		}
+		cl_int err = clEnqueueNDRangeKernel(queue, kernel, 1, 0, &global_size, &local_size, 0, nullptr, nullptr);
+		assert_cl_success(err, "Error enqueuing OpenCL kernel");
+	}
+
+	void flush() {
+		clFlush(queue);
+	}
+
+	// With pooled queues this also waits for work other threads put on the same queue
+	void finish_queue() {
+		clFinish(queue);
+		current_kernel_arg = 0;
+	}
+
+private:
+	std::function<cl_kernel(const char*)> kernel_factory;
+	cl_command_queue queue;
+	bool owns_queue;
+	std::unordered_map<std::string, cl_kernel> kernels;
+	cl_kernel kernel = nullptr;
+	int current_kernel_arg = 0;
+};
+
+// One device, context and set of built programs shared by many host threads. Each
+// thread calls local() to get its own CL_Submitter; after the first call from a thread
+// that lookup touches only thread-local data, so submission takes no locks.
+// num_queues = 0 gives every thread its own queue, otherwise threads share a pool of
+// that many queues round-robin.
+class CL_Concurrent_Util {
+public:
+	CL_Concurrent_Util(std::vector<std::string> extensions = {}, std::vector<std::string> keywords = {}, int num_queues = 0) : num_queues(num_queues) {
+		CL_Hardware_Info hardware_info(extensions, keywords);
+		device_id = hardware_info.device_to_use;
+		_init();
+	}
+
+	CL_Concurrent_Util(cl_device_id device_id, int num_queues = 0) : device_id(device_id), num_queues(num_queues) {
+		_init();
+	}
+
+	~CL_Concurrent_Util() {
+		for (auto& weak : submitters) {
+			if (auto submitter = weak.lock())
+				submitter->detach();
+		}
+		for (auto& queue : queues)
+			clReleaseCommandQueue(queue);
+		for (auto& program : programs)
+			clReleaseProgram(program);
+		clReleaseContext(context);
+	}
+
+	CL_Concurrent_Util(const CL_Concurrent_Util&) = delete;
+	CL_Concurrent_Util& operator=(const CL_Concurrent_Util&) = delete;
+
+	cl_device_id get_device_id() { return device_id; }
+	cl_context get_context() { return context; }
+
+	// Submitters of threads that are still running
+	int get_num_submitters() {
+		std::lock_guard<std::mutex> lock(mutex);
+		_prune_submitters();
+		return (int)submitters.size();
+	}
+
+	// Builds a program once for every thread to use
+	void add_program(const char* filename, CL_Build_Options options = CL_Build_Options()) {
+		cl_int err;
+
+		std::string s = read_file(filename);
+		const char* program_source = s.c_str();
+		size_t source_length = 0;
+
+		cl_program program = clCreateProgramWithSource(context, 1, &program_source, &source_length, &err);
+		assert_cl_success(err, "Error creating program");
+
+		err = clBuildProgram(program, 1, &device_id, options.c_str(), nullptr, nullptr);
+		assert_program_build_success(program, device_id, err, options.str());
+
+		std::lock_guard<std::mutex> lock(mutex);
+		programs.push_back(program);
+	}
+
+	// clCreateBuffer and the memory tracker are thread safe, so buffers can be made and
+	// released from any thread
+	CL_Buffer create_buffer(size_t size, cl_mem_flags flags, const std::string& tag = "untagged") {
+		cl_mem buffer = memory_tracker->create_buffer(context, size, flags, tag);
+		if (!buffer)
+			memory_tracker->fail_allocation("OpenCL buffer", size);
+		return CL_Buffer(buffer, size);
+	}
+
+	void release_buffer(CL_Buffer buffer) {
+		if (!buffer.buffer)
+			return;
+		memory_tracker->remove(buffer.buffer);
+		clReleaseMemObject(buffer.buffer);
+	}
+
+	// Budget, trim callbacks and leak report for the buffers of every thread
+	std::shared_ptr<CL_Memory_Tracker> get_memory_tracker() { return memory_tracker; }
+
+	CL_Submitter& local() {
+		// Keyed by a per-instance id rather than the address, which can be reused. The thread
+		// owns its submitters, so they are freed when it exits.
+		thread_local std::unordered_map<unsigned long long, std::shared_ptr<CL_Submitter>> thread_submitters;
+
+		auto it = thread_submitters.find(id);
+		if (it != thread_submitters.end())
+			return *it->second;
+
+		// Entries of utils destroyed since this thread last used them
+		for (auto entry = thread_submitters.begin(); entry != thread_submitters.end();) {
+			if (entry->second->is_detached())
+				entry = thread_submitters.erase(entry);
+			else
+				entry++;
+		}
+
+		std::shared_ptr<CL_Submitter> submitter = _create_submitter();
+		thread_submitters[id] = submitter;
+		return *submitter;
+	}
+
+	// Waits for work from every thread
+	void finish_all() {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto& queue : queues)
+			clFinish(queue);
+		for (auto& weak : submitters) {
+			auto submitter = weak.lock();
+			if (submitter && submitter->get_queue())
+				clFinish(submitter->get_queue());
+		}
+	}
+
+private:
+	cl_device_id device_id;
+	cl_context context;
+	std::vector<cl_program> programs;
+	std::vector<cl_command_queue> queues;
+	std::vector<std::weak_ptr<CL_Submitter>> submitters;
+	std::shared_ptr<CL_Memory_Tracker> memory_tracker = std::make_shared<CL_Memory_Tracker>("CL_Concurrent_Util");
+
+	int num_queues;
+	int next_queue = 0;
+	unsigned long long id;
+	std::mutex mutex;
+
+	static std::atomic<unsigned long long>& _next_id() {
+		static std::atomic<unsigned long long> next_id{ 1 };
+		return next_id;
+	}
+
+	void _init() {
+		id = _next_id()++;
+
+		cl_int err;
+		context = clCreateContext(nullptr, 1, &device_id, nullptr, nullptr, &err);
+		assert_cl_success(err, "Error creating OpenCL context");
+
+		for (int i = 0; i < num_queues; i++)
+			queues.push_back(_create_queue());
+	}
+
+	cl_command_queue _create_queue() {
+		cl_int err;
+		cl_command_queue queue = clCreateCommandQueueWithProperties(context, device_id, 0, &err);
+		assert_cl_success(err, "Error creating OpenCL command queue");
+		return queue;
+	}
+
+	std::shared_ptr<CL_Submitter> _create_submitter() {
+		std::lock_guard<std::mutex> lock(mutex);
+
+		// Without a pool each thread's queue belongs to its submitter and goes with it
+		cl_command_queue queue;
+		if (num_queues > 0) {
+			queue = queues[next_queue];
+			next_queue = (next_queue + 1) % num_queues;
+		}
+		else {
+			queue = _create_queue();
+		}
+
+		std::shared_ptr<CL_Submitter> submitter(new CL_Submitter([this](const char* function_name) { return _create_kernel(function_name); }, queue, num_queues == 0));
+		_prune_submitters();
+		submitters.push_back(submitter);
+		return submitter;
+	}
+
+	void _prune_submitters() {
+		submitters.erase(std::remove_if(submitters.begin(), submitters.end(), [](const std::weak_ptr<CL_Submitter>& weak) { return weak.expired(); }), submitters.end());
+	}
+
+	// Creates a fresh kernel object from whichever shared program defines the function
+	cl_kernel _create_kernel(const char* function_name) {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto& program : programs) {
+			cl_int err;
+			cl_kernel kernel = clCreateKernel(program, function_name, &err);
+			if (err == CL_SUCCESS)
+				return kernel;
+		}
+		std::cout << "Error! No program defines the kernel: " << function_name << "\n";
+		exit(1);
+	}
+};
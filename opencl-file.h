@@ -0,0 +1,336 @@
+#pragma once
+#include "opencl-util.h"
+#include <memory>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// A whole file mapped into memory. READ maps an existing file copy-on-write, so the
+// mapping can back a buffer that kernels write to without touching the file. WRITE
+// creates or truncates the file to the given size and maps it shared.
+class CL_Mapped_File {
+public:
+	enum Mode { READ, WRITE };
+
+	CL_Mapped_File(std::string path, Mode mode, size_t write_size = 0) : path(path), mode(mode) {
+		if (mode == WRITE)
+			size = write_size;
+		_open();
+	}
+
+	~CL_Mapped_File() {
+		_close();
+	}
+
+	CL_Mapped_File(const CL_Mapped_File&) = delete;
+	CL_Mapped_File& operator=(const CL_Mapped_File&) = delete;
+
+	void* data() { return ptr; }
+	size_t get_size() { return size; }
+	const std::string& get_path() { return path; }
+
+	// Hints that [offset, offset + length) is about to be read
+	void prefetch(size_t offset, size_t length) {
+#ifndef _WIN32
+		if (ptr && length > 0) {
+			size_t begin = _page_floor(offset);
+			madvise((char*)ptr + begin, std::min(size, offset + length) - begin, MADV_WILLNEED);
+		}
+#endif
+	}
+
+	// Drops pages that are no longer needed from the resident set. They are clean, so the
+	// next access simply reads the file again.
+	void evict(size_t offset, size_t length) {
+#ifndef _WIN32
+		if (ptr && mode == READ && length > 0) {
+			size_t begin = _page_ceil(offset);
+			size_t end = offset + length >= size ? size : _page_floor(offset + length);
+			if (end > begin)
+				madvise((char*)ptr + begin, end - begin, MADV_DONTNEED);
+		}
+#endif
+	}
+
+	// Writes dirty pages of a WRITE mapping back to the file
+	void flush() {
+		if (!ptr || mode != WRITE)
+			return;
+#ifdef _WIN32
+		FlushViewOfFile(ptr, 0);
+#else
+		msync(ptr, size, MS_SYNC);
+#endif
+	}
+
+private:
+	std::string path;
+	Mode mode;
+	size_t size = 0;
+	void* ptr = nullptr;
+
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#else
+	int file = -1;
+#endif
+
+	static size_t _page_size() {
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return (size_t)info.dwPageSize;
+#else
+		return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+	}
+
+	static size_t _page_floor(size_t offset) {
+		return offset / _page_size() * _page_size();
+	}
+
+	static size_t _page_ceil(size_t offset) {
+		return (offset + _page_size() - 1) / _page_size() * _page_size();
+	}
+
+	void _fail(const char* message) {
+		std::cout << message << ": " << path << "\n";
+		exit(1);
+	}
+
+#ifdef _WIN32
+	void _open() {
+		if (mode == READ)
+			file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		else
+			file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			_fail("Error opening file");
+
+		if (mode == READ) {
+			LARGE_INTEGER file_size;
+			GetFileSizeEx(file, &file_size);
+			size = (size_t)file_size.QuadPart;
+		}
+		if (size == 0)
+			return;
+
+		DWORD protect = mode == READ ? PAGE_WRITECOPY : PAGE_READWRITE;
+		mapping = CreateFileMappingA(file, nullptr, protect, (DWORD)((unsigned long long)size >> 32), (DWORD)(size & 0xFFFFFFFF), nullptr);
+		if (!mapping)
+			_fail("Error mapping file");
+
+		ptr = MapViewOfFile(mapping, mode == READ ? FILE_MAP_COPY : FILE_MAP_WRITE, 0, 0, size);
+		if (!ptr)
+			_fail("Error mapping file");
+	}
+
+	void _close() {
+		if (ptr)
+			UnmapViewOfFile(ptr);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+	}
+#else
+	void _open() {
+		file = mode == READ ? open(path.c_str(), O_RDONLY) : open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (file < 0)
+			_fail("Error opening file");
+
+		if (mode == READ) {
+			struct stat info;
+			if (fstat(file, &info) != 0)
+				_fail("Error reading file size");
+			size = (size_t)info.st_size;
+		}
+		else if (ftruncate(file, (off_t)size) != 0) {
+			_fail("Error resizing file");
+		}
+		if (size == 0)
+			return;
+
+		ptr = mode == READ
+			? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0)
+			: mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+		if (ptr == MAP_FAILED) {
+			ptr = nullptr;
+			_fail("Error mapping file");
+		}
+		if (mode == READ)
+			madvise(ptr, size, MADV_SEQUENTIAL);
+	}
+
+	void _close() {
+		if (ptr)
+			munmap(ptr, size);
+		if (file >= 0)
+			close(file);
+	}
+#endif
+};
+
+// Moves whole files between disk and device buffers without an intermediate host copy.
+//
+// WRAP turns the mapped file itself into a CL_MEM_USE_HOST_PTR buffer, which is zero-copy
+// on devices that share host memory. STREAM creates a device buffer and writes the mapping
+// in chunks, keeping a few chunks in flight so reading the file overlaps the transfers and
+// evicting each chunk once it is on the device. AUTO picks WRAP for devices with unified
+// host memory and STREAM otherwise. Either way no second host-side copy of the file is made.
+class CL_File_IO {
+public:
+	enum Mode { AUTO, WRAP, STREAM };
+
+	CL_File_IO(CL_Util& util) : util(util) {
+
+	}
+
+	~CL_File_IO() {
+		while (!wrapped.empty())
+			release_buffer(CL_Buffer(wrapped.begin()->first, 0));
+	}
+
+	CL_File_IO(const CL_File_IO&) = delete;
+	CL_File_IO& operator=(const CL_File_IO&) = delete;
+
+	void set_chunk_size(size_t size) { chunk_size = size; }
+	void set_chunks_in_flight(int count) { chunks_in_flight = std::max(count, 1); }
+
+	// A wrapped buffer keeps its file mapped until release_buffer or until this object is destroyed
+	CL_Buffer load_file_to_buffer(std::string path, cl_mem_flags flags = CL_MEM_READ_ONLY, Mode mode = AUTO) {
+		std::unique_ptr<CL_Mapped_File> file(new CL_Mapped_File(path, CL_Mapped_File::READ));
+		size_t size = file->get_size();
+
+		// No device buffer can have size 0; release_buffer and save_buffer_to_file accept the empty one
+		if (size == 0)
+			return CL_Buffer(nullptr, 0);
+
+		if (mode == AUTO)
+			mode = _has_unified_memory() ? WRAP : STREAM;
+
+		if (mode == WRAP) {
+			util.reserve_memory(size, "wrapped file buffer");
+			cl_mem buffer;
+			if (util.is_native()) {
+				buffer = (cl_mem)file->data();
+			}
+			else {
+				cl_int err;
+				buffer = clCreateBuffer(util.get_context(), flags | CL_MEM_USE_HOST_PTR, size, file->data(), &err);
+				assert_cl_success(err, "Error creating OpenCL buffer");
+			}
+			wrapped[buffer] = std::move(file);
+			util.track_memory(buffer, size, "CL_File_IO");
+			return CL_Buffer(buffer, size);
+		}
+
+		CL_Buffer buffer = util.create_buffer(size, flags, "CL_File_IO");
+		_transfer(file.get(), buffer.buffer, size, true);
+		return buffer;
+	}
+
+	// Writes the whole buffer to a file, reading it straight into the mapped output
+	void save_buffer_to_file(std::string path, CL_Buffer buffer) {
+		CL_Mapped_File file(path, CL_Mapped_File::WRITE, buffer.size);
+		_transfer(&file, buffer.buffer, buffer.size, false);
+		file.flush();
+	}
+
+	void release_buffer(CL_Buffer buffer) {
+		auto it = wrapped.find(buffer.buffer);
+		if (it != wrapped.end()) {
+			util.untrack_memory(buffer.buffer);
+			if (!util.is_native()) {
+				clFinish(util.get_queue());
+				clReleaseMemObject(buffer.buffer);
+			}
+			wrapped.erase(it);
+			return;
+		}
+		util.release_buffer(buffer);
+	}
+
+	size_t get_num_wrapped_files() { return wrapped.size(); }
+
+private:
+	CL_Util& util;
+	size_t chunk_size = 64 << 20;
+	int chunks_in_flight = 4;
+	std::map<cl_mem, std::unique_ptr<CL_Mapped_File>> wrapped;
+
+	bool _has_unified_memory() {
+		if (util.is_native())
+			return true;
+		cl_bool unified = CL_FALSE;
+		clGetDeviceInfo(util.get_device_id(), CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified), &unified, nullptr);
+		return unified == CL_TRUE;
+	}
+
+	// Chunked non-blocking transfers between the mapping and the buffer, at most
+	// chunks_in_flight outstanding
+	void _transfer(CL_Mapped_File* file, cl_mem buffer, size_t size, bool to_device) {
+		char* data = (char*)file->data();
+		size_t num_chunks = (size + chunk_size - 1) / chunk_size;
+
+		if (util.is_native()) {
+			for (size_t i = 0; i < num_chunks; i++) {
+				size_t offset = i * chunk_size;
+				size_t length = std::min(chunk_size, size - offset);
+				if (to_device) {
+					file->prefetch(offset + length, chunk_size);
+					memcpy((char*)buffer + offset, data + offset, length);
+					file->evict(offset, length);
+				}
+				else {
+					memcpy(data + offset, (char*)buffer + offset, length);
+				}
+			}
+			return;
+		}
+
+		std::vector<cl_event> events(num_chunks, nullptr);
+		for (size_t i = 0; i < num_chunks; i++) {
+			size_t offset = i * chunk_size;
+			size_t length = std::min(chunk_size, size - offset);
+
+			if (i >= (size_t)chunks_in_flight)
+				_complete_chunk(file, events, i - chunks_in_flight, size, to_device);
+
+			if (to_device)
+				file->prefetch(offset + length, chunk_size);
+
+			cl_int err;
+			if (to_device)
+				err = clEnqueueWriteBuffer(util.get_queue(), buffer, CL_FALSE, offset, length, data + offset, 0, nullptr, &events[i]);
+			else
+				err = clEnqueueReadBuffer(util.get_queue(), buffer, CL_FALSE, offset, length, data + offset, 0, nullptr, &events[i]);
+			assert_cl_success(err, to_device ? "Error writing to buffer" : "Error reading from buffer");
+			clFlush(util.get_queue());
+		}
+
+		size_t first_pending = num_chunks > (size_t)chunks_in_flight ? num_chunks - chunks_in_flight : 0;
+		for (size_t i = first_pending; i < num_chunks; i++)
+			_complete_chunk(file, events, i, size, to_device);
+	}
+
+	void _complete_chunk(CL_Mapped_File* file, std::vector<cl_event>& events, size_t i, size_t size, bool to_device) {
+		clWaitForEvents(1, &events[i]);
+		clReleaseEvent(events[i]);
+		events[i] = nullptr;
+
+		size_t offset = i * chunk_size;
+		if (to_device)
+			file->evict(offset, std::min(chunk_size, size - offset));
+	}
+};
@@ -0,0 +1,352 @@
+#pragma once
+#include "opencl-util.h"
+
+// One kernel argument of a recorded launch: a fixed buffer, a fixed scalar, or a
+// graph parameter that can be rebound between replays
+struct CL_Graph_Arg {
+	enum Kind { BUFFER, VALUE, PARAM };
+
+	Kind kind;
+	cl_mem buffer = nullptr;
+	std::vector<unsigned char> value;
+	int param = -1;
+
+	static CL_Graph_Arg from_buffer(cl_mem buffer) {
+		CL_Graph_Arg arg;
+		arg.kind = BUFFER;
+		arg.buffer = buffer;
+		return arg;
+	}
+
+	static CL_Graph_Arg from_buffer(CL_Buffer buffer) {
+		return from_buffer(buffer.buffer);
+	}
+
+	template <typename T>
+	static CL_Graph_Arg from_value(T value) {
+		CL_Graph_Arg arg;
+		arg.kind = VALUE;
+		arg.value.resize(sizeof(T));
+		memcpy(arg.value.data(), &value, sizeof(T));
+		return arg;
+	}
+
+	static CL_Graph_Arg from_param(int param) {
+		CL_Graph_Arg arg;
+		arg.kind = PARAM;
+		arg.param = param;
+		return arg;
+	}
+};
+
+// Records a sequence of writes, kernel launches and reads once and replays it with
+// minimal host work. Every launch owns its own kernel object so its arguments stay
+// bound between replays; only arguments whose parameter changed are set again.
+// Commands go to an out-of-order queue when the device has one, ordered only by the
+// dependencies given when recording, and each replay ends with a single flush.
+class CL_Command_Graph {
+public:
+	CL_Command_Graph(CL_Util& util) : context(util.get_context()), device_id(util.get_device_id()), program(util.get_program()) {
+		cl_command_queue_properties supported = 0;
+		clGetDeviceInfo(device_id, CL_DEVICE_QUEUE_ON_HOST_PROPERTIES, sizeof(supported), &supported, nullptr);
+
+		if (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) {
+			cl_int err;
+			cl_queue_properties props[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, 0 };
+			queue = clCreateCommandQueueWithProperties(context, device_id, props, &err);
+			assert_cl_success(err, "Error creating OpenCL command queue");
+		}
+		else {
+			queue = util.get_queue();
+			clRetainCommandQueue(queue);
+		}
+	}
+
+	~CL_Command_Graph() {
+		_release_events();
+		for (auto& node : nodes) {
+			if (node.kernel)
+				clReleaseKernel(node.kernel);
+		}
+		clReleaseCommandQueue(queue);
+	}
+
+	CL_Command_Graph(const CL_Command_Graph&) = delete;
+	CL_Command_Graph& operator=(const CL_Command_Graph&) = delete;
+
+	cl_command_queue get_queue() { return queue; }
+	int get_num_nodes() { return (int)nodes.size(); }
+
+	// Parameters are placeholders bound with set_param before (or between) replays
+
+	int add_param() {
+		params.push_back(Param());
+		return (int)params.size() - 1;
+	}
+
+	void set_param(int param, cl_mem buffer) {
+		_check_param(param);
+		params[param].buffer = buffer;
+		params[param].value.clear();
+		_mark_param_dirty(param);
+	}
+
+	void set_param(int param, CL_Buffer buffer) {
+		set_param(param, buffer.buffer);
+	}
+
+	template <typename T>
+	void set_param_value(int param, T value) {
+		_check_param(param);
+		params[param].value.resize(sizeof(T));
+		memcpy(params[param].value.data(), &value, sizeof(T));
+		_mark_param_dirty(param);
+	}
+
+	// Host pointer used by write/read nodes recorded with a parameter
+	void set_param_host_ptr(int param, void* host_ptr) {
+		_check_param(param);
+		params[param].host_ptr = host_ptr;
+	}
+
+	// Recording. Each call returns the node id to use in later dependency lists.
+
+	int write(CL_Graph_Arg buffer, const void* host_ptr, size_t size, std::vector<int> dependencies = {}) {
+		return _add_transfer(Node::WRITE, buffer, -1, (void*)host_ptr, size, dependencies);
+	}
+
+	int write(CL_Graph_Arg buffer, int host_param, size_t size, std::vector<int> dependencies = {}) {
+		_check_param(host_param);
+		return _add_transfer(Node::WRITE, buffer, host_param, nullptr, size, dependencies);
+	}
+
+	int read(CL_Graph_Arg buffer, void* host_ptr, size_t size, std::vector<int> dependencies = {}) {
+		return _add_transfer(Node::READ, buffer, -1, host_ptr, size, dependencies);
+	}
+
+	int read(CL_Graph_Arg buffer, int host_param, size_t size, std::vector<int> dependencies = {}) {
+		_check_param(host_param);
+		return _add_transfer(Node::READ, buffer, host_param, nullptr, size, dependencies);
+	}
+
+	int kernel(const char* function_name, std::vector<CL_Graph_Arg> args, std::vector<size_t> global_size, std::vector<size_t> local_size = {},
+		std::vector<int> dependencies = {}) {
+		_check_dependencies(dependencies);
+		if (global_size.size() < 1 || global_size.size() > 3) {
+			std::cout << "Work dimension must be 1, 2 or 3!" << "\n";
+			exit(1);
+		}
+		for (int i = 0; i < (int)local_size.size(); i++) {
+			if (local_size.size() != global_size.size() || local_size[i] == 0 || global_size[i] % local_size[i] != 0) {
+				std::cout << "Global item size must be divisible by local item size!" << "\n\n";
+				exit(1);
+			}
+		}
+
+		Node node;
+		node.type = Node::KERNEL;
+		node.dependencies = dependencies;
+		node.args = args;
+		node.global_size = global_size;
+		node.local_size = local_size;
+
+		cl_int err;
+		node.kernel = clCreateKernel(program, function_name, &err);
+		assert_cl_success(err, "Error creating OpenCL kernel");
+
+		for (int i = 0; i < (int)args.size(); i++) {
+			if (args[i].kind == CL_Graph_Arg::PARAM) {
+				_check_param(args[i].param);
+				node.dirty_args.push_back(i);
+			}
+			else {
+				_bind_arg(node.kernel, i, args[i]);
+			}
+		}
+
+		nodes.push_back(node);
+		return (int)nodes.size() - 1;
+	}
+
+	// Enqueues the whole graph with a single flush. With wait = false the caller
+	// synchronizes later through wait() or the queue.
+	void replay(bool wait = true) {
+		auto start = std::chrono::high_resolution_clock::now();
+
+		// A replay reuses the same buffers, so it cannot overlap the previous one
+		this->wait();
+		_release_events();
+		events.assign(nodes.size(), nullptr);
+
+		std::vector<cl_event> wait_list;
+		for (int i = 0; i < (int)nodes.size(); i++) {
+			Node& node = nodes[i];
+
+			wait_list.clear();
+			for (int dependency : node.dependencies)
+				wait_list.push_back(events[dependency]);
+			const cl_event* wait_ptr = wait_list.empty() ? nullptr : wait_list.data();
+
+			cl_int err;
+			if (node.type == Node::KERNEL) {
+				for (int arg : node.dirty_args)
+					_bind_arg(node.kernel, arg, node.args[arg]);
+				node.dirty_args.clear();
+
+				err = clEnqueueNDRangeKernel(queue, node.kernel, (cl_uint)node.global_size.size(), nullptr, node.global_size.data(),
+					node.local_size.empty() ? nullptr : node.local_size.data(), (cl_uint)wait_list.size(), wait_ptr, &events[i]);
+				assert_cl_success(err, "Error enqueuing OpenCL kernel");
+			}
+			else {
+				cl_mem buffer = _resolve_buffer(node.buffer);
+				void* host_ptr = node.host_param >= 0 ? params[node.host_param].host_ptr : node.host_ptr;
+
+				if (node.type == Node::WRITE)
+					err = clEnqueueWriteBuffer(queue, buffer, CL_FALSE, 0, node.size, host_ptr, (cl_uint)wait_list.size(), wait_ptr, &events[i]);
+				else
+					err = clEnqueueReadBuffer(queue, buffer, CL_FALSE, 0, node.size, host_ptr, (cl_uint)wait_list.size(), wait_ptr, &events[i]);
+				assert_cl_success(err, "Error enqueuing OpenCL buffer transfer");
+			}
+		}
+		clFlush(queue);
+
+		host_seconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+		num_replays++;
+
+		if (wait)
+			this->wait();
+	}
+
+	void wait() {
+		if (!events.empty())
+			clWaitForEvents((cl_uint)events.size(), events.data());
+	}
+
+	// Host time spent inside replay() (excluding the wait), averaged over all replays
+	double get_average_replay_overhead_us() {
+		if (num_replays == 0)
+			return 0;
+		return host_seconds / (double)num_replays * 1e6;
+	}
+
+	long long get_num_replays() { return num_replays; }
+
+	void reset_stats() {
+		host_seconds = 0;
+		num_replays = 0;
+	}
+
+private:
+	struct Param {
+		cl_mem buffer = nullptr;
+		std::vector<unsigned char> value;
+		void* host_ptr = nullptr;
+	};
+
+	struct Node {
+		enum Type { WRITE, KERNEL, READ };
+
+		Type type;
+		std::vector<int> dependencies;
+
+		cl_kernel kernel = nullptr;
+		std::vector<CL_Graph_Arg> args;
+		std::vector<int> dirty_args;
+		std::vector<size_t> global_size;
+		std::vector<size_t> local_size;
+
+		CL_Graph_Arg buffer;
+		void* host_ptr = nullptr;
+		int host_param = -1;
+		size_t size = 0;
+	};
+
+	cl_context context;
+	cl_device_id device_id;
+	cl_program program;
+	cl_command_queue queue;
+
+	std::vector<Param> params;
+	std::vector<Node> nodes;
+	std::vector<cl_event> events;
+
+	double host_seconds = 0;
+	long long num_replays = 0;
+
+	void _check_param(int param) {
+		if (param < 0 || param >= (int)params.size()) {
+			std::cout << "Error! Command graph parameter " << param << " does not exist" << "\n";
+			exit(1);
+		}
+	}
+
+	void _check_dependencies(const std::vector<int>& dependencies) {
+		for (int dependency : dependencies) {
+			if (dependency < 0 || dependency >= (int)nodes.size()) {
+				std::cout << "Error! Command graph nodes can only depend on nodes recorded before them" << "\n";
+				exit(1);
+			}
+		}
+	}
+
+	int _add_transfer(Node::Type type, CL_Graph_Arg buffer, int host_param, void* host_ptr, size_t size, const std::vector<int>& dependencies) {
+		_check_dependencies(dependencies);
+		if (buffer.kind == CL_Graph_Arg::VALUE) {
+			std::cout << "Error! Command graph transfers need a buffer or buffer parameter" << "\n";
+			exit(1);
+		}
+		if (buffer.kind == CL_Graph_Arg::PARAM)
+			_check_param(buffer.param);
+
+		Node node;
+		node.type = type;
+		node.dependencies = dependencies;
+		node.buffer = buffer;
+		node.host_param = host_param;
+		node.host_ptr = host_ptr;
+		node.size = size;
+
+		nodes.push_back(node);
+		return (int)nodes.size() - 1;
+	}
+
+	void _mark_param_dirty(int param) {
+		for (auto& node : nodes) {
+			for (int i = 0; i < (int)node.args.size(); i++) {
+				if (node.args[i].kind == CL_Graph_Arg::PARAM && node.args[i].param == param
+					&& std::find(node.dirty_args.begin(), node.dirty_args.end(), i) == node.dirty_args.end())
+					node.dirty_args.push_back(i);
+			}
+		}
+	}
+
+	cl_mem _resolve_buffer(const CL_Graph_Arg& arg) {
+		return arg.kind == CL_Graph_Arg::PARAM ? params[arg.param].buffer : arg.buffer;
+	}
+
+	void _bind_arg(cl_kernel kernel, int index, const CL_Graph_Arg& arg) {
+		cl_int err;
+		if (arg.kind == CL_Graph_Arg::BUFFER) {
+			err = clSetKernelArg(kernel, (cl_uint)index, sizeof(cl_mem), &arg.buffer);
+		}
+		else if (arg.kind == CL_Graph_Arg::VALUE) {
+			err = clSetKernelArg(kernel, (cl_uint)index, arg.value.size(), arg.value.data());
+		}
+		else {
+			Param& param = params[arg.param];
+			if (param.value.empty())
+				err = clSetKernelArg(kernel, (cl_uint)index, sizeof(cl_mem), &param.buffer);
+			else
+				err = clSetKernelArg(kernel, (cl_uint)index, param.value.size(), param.value.data());
+		}
+		assert_cl_success(err, "Error setting OpenCL kernel arg");
+	}
+
+	void _release_events() {
+		for (auto& event : events) {
+			if (event)
+				clReleaseEvent(event);
+		}
+		events.clear();
+	}
+};
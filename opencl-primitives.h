@@ -0,0 +1,738 @@
+#pragma once
+#include "opencl-util.h"
+#include "vec2.h"
+#include <limits>
+#include <numeric>
+#include <type_traits>
+
+// Parallel primitives on CL_Buffers: reduce, scan, radix sort, histogram and stream
+// compaction. Kernels use work-group local memory, sub-group reductions when the device
+// has cl_khr_subgroups, and extra passes when the input is larger than one launch can
+// combine. On the native backend the same calls run on the host.
+
+static const char* cl_reduce_source = R"CLC(
+#ifdef USE_SUBGROUPS
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#endif
+
+#ifndef IN_T
+#define IN_T T
+#endif
+
+#if defined(OP_SUM)
+#define IDENTITY ((T)0)
+#define OP(a, b) ((a) + (b))
+#define SUB_REDUCE(x) sub_group_reduce_add(x)
+#elif defined(OP_MIN)
+#define IDENTITY (T_MAX)
+#define OP(a, b) min(a, b)
+#define SUB_REDUCE(x) sub_group_reduce_min(x)
+#elif defined(OP_MAX)
+#define IDENTITY (T_MIN)
+#define OP(a, b) max(a, b)
+#define SUB_REDUCE(x) sub_group_reduce_max(x)
+#elif defined(OP_BBOX)
+#define IDENTITY ((float4)(INFINITY, INFINITY, -INFINITY, -INFINITY))
+#define OP(a, b) ((float4)(fmin((a).xy, (b).xy), fmax((a).zw, (b).zw)))
+#define LOAD(v) ((float4)((v), (v)))
+#endif
+
+#ifndef LOAD
+#define LOAD(v) (v)
+#endif
+
+// Result is only valid in work item 0
+T group_reduce(T acc, __local T* scratch) {
+	const uint lid = get_local_id(0);
+#if defined(USE_SUBGROUPS) && defined(SUB_REDUCE)
+	T partial = SUB_REDUCE(acc);
+	if (get_sub_group_local_id() == 0)
+		scratch[get_sub_group_id()] = partial;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	T result = IDENTITY;
+	if (get_sub_group_id() == 0) {
+		for (uint i = get_sub_group_local_id(); i < get_num_sub_groups(); i += get_sub_group_size())
+			result = OP(result, scratch[i]);
+		result = SUB_REDUCE(result);
+	}
+	return result;
+#else
+	scratch[lid] = acc;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint s = get_local_size(0) / 2; s > 0; s >>= 1) {
+		if (lid < s)
+			scratch[lid] = OP(scratch[lid], scratch[lid + s]);
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	return scratch[0];
+#endif
+}
+
+__kernel void reduce_first(__global const IN_T* in, __global T* out, const uint n, __local T* scratch) {
+	T acc = IDENTITY;
+	for (uint i = get_global_id(0); i < n; i += get_global_size(0))
+		acc = OP(acc, LOAD(in[i]));
+	T result = group_reduce(acc, scratch);
+	if (get_local_id(0) == 0)
+		out[get_group_id(0)] = result;
+}
+
+__kernel void reduce_next(__global const T* in, __global T* out, const uint n, __local T* scratch) {
+	T acc = IDENTITY;
+	for (uint i = get_global_id(0); i < n; i += get_global_size(0))
+		acc = OP(acc, in[i]);
+	T result = group_reduce(acc, scratch);
+	if (get_local_id(0) == 0)
+		out[get_group_id(0)] = result;
+}
+)CLC";
+
+static const char* cl_scan_source = R"CLC(
+// Work-efficient scan of 2 * local_size elements per group. Writes the exclusive (or
+// inclusive) scan of the block and the block's total. Safe to run in place.
+__kernel void scan_blocks(__global const T* in, __global T* out, __global T* block_sums, const uint n, const uint inclusive, __local T* temp) {
+	const uint lid = get_local_id(0);
+	const uint half_block = get_local_size(0);
+	const uint block = 2 * half_block;
+	const uint base = get_group_id(0) * block;
+
+	T a = base + lid < n ? in[base + lid] : (T)0;
+	T b = base + lid + half_block < n ? in[base + lid + half_block] : (T)0;
+	temp[lid] = a;
+	temp[lid + half_block] = b;
+
+	uint offset = 1;
+	for (uint d = half_block; d > 0; d >>= 1) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d) {
+			uint x = offset * (2 * lid + 1) - 1;
+			uint y = offset * (2 * lid + 2) - 1;
+			temp[y] += temp[x];
+		}
+		offset <<= 1;
+	}
+
+	if (lid == 0) {
+		block_sums[get_group_id(0)] = temp[block - 1];
+		temp[block - 1] = 0;
+	}
+
+	for (uint d = 1; d < block; d <<= 1) {
+		offset >>= 1;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d) {
+			uint x = offset * (2 * lid + 1) - 1;
+			uint y = offset * (2 * lid + 2) - 1;
+			T t = temp[x];
+			temp[x] = temp[y];
+			temp[y] += t;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (base + lid < n)
+		out[base + lid] = inclusive ? temp[lid] + a : temp[lid];
+	if (base + lid + half_block < n)
+		out[base + lid + half_block] = inclusive ? temp[lid + half_block] + b : temp[lid + half_block];
+}
+
+__kernel void add_block_offsets(__global T* out, __global const T* offsets, const uint n, const uint block) {
+	uint i = get_global_id(0);
+	if (i < n)
+		out[i] += offsets[i / block];
+}
+)CLC";
+
+static const char* cl_radix_source = R"CLC(
+#define RADIX 16
+
+// Digit counts per group, stored digit-major so one exclusive scan gives every
+// (digit, group) its first output position
+__kernel void radix_histogram(__global const uint* keys, const uint n, const uint shift, __global uint* hist) {
+	__local uint local_hist[RADIX];
+	const uint lid = get_local_id(0);
+	for (uint d = lid; d < RADIX; d += get_local_size(0))
+		local_hist[d] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint i = get_global_id(0);
+	if (i < n)
+		atomic_inc(&local_hist[(keys[i] >> shift) & (RADIX - 1)]);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint d = lid; d < RADIX; d += get_local_size(0))
+		hist[d * get_num_groups(0) + get_group_id(0)] = local_hist[d];
+}
+
+// Stable scatter. An element's rank is the number of earlier elements in its group with
+// the same digit. It comes from one inclusive scan over the group of one-hot digit counts,
+// packed two 16-bit counters per uint, so every digit is ranked in log2(local size) steps.
+__kernel void radix_scatter(__global const uint* keys_in, __global uint* keys_out, __global const uint* values_in, __global uint* values_out,
+	const uint has_values, const uint n, const uint shift, __global const uint* offsets, __local uint* counts) {
+	const uint lid = get_local_id(0);
+	const uint local_size = get_local_size(0);
+	const uint i = get_global_id(0);
+
+	// Padding items get digit RADIX, which matches no counter
+	uint digit = i < n ? (keys_in[i] >> shift) & (RADIX - 1) : RADIX;
+	uint own[RADIX / 2], sum[RADIX / 2];
+	for (uint k = 0; k < RADIX / 2; k++) {
+		own[k] = digit / 2 == k ? 1u << (16 * (digit & 1)) : 0;
+		sum[k] = own[k];
+		counts[k * local_size + lid] = sum[k];
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint offset = 1; offset < local_size; offset <<= 1) {
+		uint add[RADIX / 2];
+		for (uint k = 0; k < RADIX / 2; k++)
+			add[k] = lid >= offset ? counts[k * local_size + lid - offset] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (uint k = 0; k < RADIX / 2; k++) {
+			sum[k] += add[k];
+			counts[k * local_size + lid] = sum[k];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (i < n) {
+		uint rank = ((sum[digit / 2] - own[digit / 2]) >> (16 * (digit & 1))) & 0xFFFF;
+
+		uint dest = offsets[digit * get_num_groups(0) + get_group_id(0)] + rank;
+		keys_out[dest] = keys_in[i];
+		if (has_values)
+			values_out[dest] = values_in[i];
+	}
+}
+)CLC";
+
+static const char* cl_histogram_source = R"CLC(
+// Counts go to local memory first when the bins fit, then one atomic per bin per group
+__kernel void histogram(__global const uint* values, const uint n, __global uint* bins, const uint num_bins, const uint use_local, __local uint* local_bins) {
+	const uint lid = get_local_id(0);
+	if (use_local) {
+		for (uint b = lid; b < num_bins; b += get_local_size(0))
+			local_bins[b] = 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	for (uint i = get_global_id(0); i < n; i += get_global_size(0)) {
+		uint v = values[i];
+		if (v < num_bins) {
+			if (use_local)
+				atomic_inc(&local_bins[v]);
+			else
+				atomic_inc(&bins[v]);
+		}
+	}
+
+	if (use_local) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (uint b = lid; b < num_bins; b += get_local_size(0)) {
+			if (local_bins[b])
+				atomic_add(&bins[b], local_bins[b]);
+		}
+	}
+}
+
+__kernel void histogram_range(__global const float* values, const uint n, const float min_value, const float max_value,
+	__global uint* bins, const uint num_bins, const uint use_local, __local uint* local_bins) {
+	const uint lid = get_local_id(0);
+	if (use_local) {
+		for (uint b = lid; b < num_bins; b += get_local_size(0))
+			local_bins[b] = 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	const float scale = (float)num_bins / (max_value - min_value);
+	for (uint i = get_global_id(0); i < n; i += get_global_size(0)) {
+		float v = values[i];
+		if (v >= min_value && v <= max_value) {
+			uint b = min((uint)((v - min_value) * scale), num_bins - 1);
+			if (use_local)
+				atomic_inc(&local_bins[b]);
+			else
+				atomic_inc(&bins[b]);
+		}
+	}
+
+	if (use_local) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (uint b = lid; b < num_bins; b += get_local_size(0)) {
+			if (local_bins[b])
+				atomic_add(&bins[b], local_bins[b]);
+		}
+	}
+}
+)CLC";
+
+static const char* cl_compact_source = R"CLC(
+__kernel void flags_to_ones(__global const uint* flags, __global uint* ones, const uint n) {
+	uint i = get_global_id(0);
+	if (i < n)
+		ones[i] = flags[i] != 0;
+}
+
+__kernel void compact_scatter(__global const T* in, __global const uint* flags, __global const uint* positions, __global T* out, const uint n) {
+	uint i = get_global_id(0);
+	if (i < n && flags[i])
+		out[positions[i]] = in[i];
+}
+)CLC";
+
+struct CL_Bounding_Box {
+	Vec2 min;
+	Vec2 max;
+};
+
+class CL_Primitives {
+public:
+	CL_Primitives(CL_Util& util) : util(util) {
+		if (!util.is_native())
+			use_subgroups = CL_Device(util.get_device_id()).supports_extension("cl_khr_subgroups");
+	}
+
+	~CL_Primitives() {
+		for (auto& entry : kernels)
+			clReleaseKernel(entry.second);
+		for (auto& entry : programs)
+			clReleaseProgram(entry.second);
+	}
+
+	CL_Primitives(const CL_Primitives&) = delete;
+	CL_Primitives& operator=(const CL_Primitives&) = delete;
+
+	// Reductions over the first n elements. T is float, int or unsigned int.
+
+	template <typename T>
+	T reduce_sum(CL_Buffer in, size_t n) {
+		if (n == 0)
+			return (T)0;
+		if (util.is_native()) {
+			T* data = (T*)in.buffer;
+			return std::accumulate(data, data + n, (T)0);
+		}
+		return _reduce<T>(in.buffer, n, "sum", "-D OP_SUM");
+	}
+
+	template <typename T>
+	T reduce_min(CL_Buffer in, size_t n) {
+		_assert_not_empty(n);
+		if (util.is_native()) {
+			T* data = (T*)in.buffer;
+			return *std::min_element(data, data + n);
+		}
+		return _reduce<T>(in.buffer, n, "min", "-D OP_MIN -D T_MAX=" + _max_literal<T>());
+	}
+
+	template <typename T>
+	T reduce_max(CL_Buffer in, size_t n) {
+		_assert_not_empty(n);
+		if (util.is_native()) {
+			T* data = (T*)in.buffer;
+			return *std::max_element(data, data + n);
+		}
+		return _reduce<T>(in.buffer, n, "max", "-D OP_MAX -D T_MIN=" + _min_literal<T>());
+	}
+
+	// Bounding box of n Vec2 points
+	CL_Bounding_Box reduce_bounding_box(CL_Buffer points, size_t n) {
+		_assert_not_empty(n);
+		float box[4];
+		if (util.is_native()) {
+			Vec2* data = (Vec2*)points.buffer;
+			box[0] = box[2] = data[0].x;
+			box[1] = box[3] = data[0].y;
+			for (size_t i = 1; i < n; i++) {
+				box[0] = std::min(box[0], data[i].x);
+				box[1] = std::min(box[1], data[i].y);
+				box[2] = std::max(box[2], data[i].x);
+				box[3] = std::max(box[3], data[i].y);
+			}
+		}
+		else {
+			_reduce_raw(points.buffer, n, "bbox", "-D T=float4 -D IN_T=float2 -D OP_BBOX", sizeof(box), box);
+		}
+		return CL_Bounding_Box{ Vec2(box[0], box[1]), Vec2(box[2], box[3]) };
+	}
+
+	// Scans of n elements of T (float, int or unsigned int). in and out may be the same buffer.
+
+	template <typename T>
+	void inclusive_scan(CL_Buffer in, CL_Buffer out, size_t n) {
+		_scan<T>(in.buffer, out.buffer, n, true);
+	}
+
+	template <typename T>
+	void exclusive_scan(CL_Buffer in, CL_Buffer out, size_t n) {
+		_scan<T>(in.buffer, out.buffer, n, false);
+	}
+
+	// Stable LSD radix sort of n unsigned int keys, four bits per pass
+
+	void sort(CL_Buffer keys, size_t n) {
+		_radix_sort(keys.buffer, nullptr, n);
+	}
+
+	// Sorts 4-byte values along with their unsigned int keys
+	void sort_by_key(CL_Buffer keys, CL_Buffer values, size_t n) {
+		_radix_sort(keys.buffer, values.buffer, n);
+	}
+
+	// Counts n unsigned int values into num_bins bins; values >= num_bins are ignored
+	void histogram(CL_Buffer values, size_t n, CL_Buffer bins, cl_uint num_bins) {
+		if (util.is_native()) {
+			unsigned int* data = (unsigned int*)values.buffer;
+			unsigned int* counts = (unsigned int*)bins.buffer;
+			std::fill(counts, counts + num_bins, 0u);
+			for (size_t i = 0; i < n; i++) {
+				if (data[i] < num_bins)
+					counts[data[i]]++;
+			}
+			return;
+		}
+		cl_kernel kernel = _get_kernel("histogram", cl_histogram_source, "", "histogram");
+		_run_histogram(kernel, values.buffer, n, bins.buffer, num_bins, {});
+	}
+
+	// Counts n floats into num_bins equal bins over [min_value, max_value]
+	void histogram_range(CL_Buffer values, size_t n, float min_value, float max_value, CL_Buffer bins, cl_uint num_bins) {
+		if (util.is_native()) {
+			float* data = (float*)values.buffer;
+			unsigned int* counts = (unsigned int*)bins.buffer;
+			std::fill(counts, counts + num_bins, 0u);
+			float scale = (float)num_bins / (max_value - min_value);
+			for (size_t i = 0; i < n; i++) {
+				if (data[i] >= min_value && data[i] <= max_value)
+					counts[std::min((unsigned int)((data[i] - min_value) * scale), num_bins - 1)]++;
+			}
+			return;
+		}
+		cl_kernel kernel = _get_kernel("histogram", cl_histogram_source, "", "histogram_range");
+		_run_histogram(kernel, values.buffer, n, bins.buffer, num_bins, { min_value, max_value });
+	}
+
+	// Copies the elements whose flag (unsigned int) is non-zero to the front of out, in
+	// order, and returns how many were kept
+	template <typename T>
+	size_t compact(CL_Buffer in, CL_Buffer flags, size_t n, CL_Buffer out) {
+		if (n == 0)
+			return 0;
+		if (util.is_native()) {
+			T* data = (T*)in.buffer;
+			unsigned int* keep = (unsigned int*)flags.buffer;
+			T* result = (T*)out.buffer;
+			size_t count = 0;
+			for (size_t i = 0; i < n; i++) {
+				if (keep[i])
+					result[count++] = data[i];
+			}
+			return count;
+		}
+
+		std::string key = std::string("compact|") + CL_Type_Name<T>::name();
+		std::string options = std::string("-D T=") + CL_Type_Name<T>::name();
+		cl_kernel to_ones = _get_kernel(key, cl_compact_source, options, "flags_to_ones");
+		cl_kernel scatter = _get_kernel(key, cl_compact_source, options, "compact_scatter");
+
+		cl_mem positions = _create_temp(n * sizeof(cl_uint));
+		cl_uint count = (cl_uint)n;
+		size_t local_size = _local_size(to_ones);
+		_set_args(to_ones, flags.buffer, positions, count);
+		_enqueue(to_ones, _round_up(n, local_size), local_size);
+
+		cl_uint last_flag;
+		cl_int err = clEnqueueReadBuffer(util.get_queue(), positions, CL_TRUE, (n - 1) * sizeof(cl_uint), sizeof(cl_uint), &last_flag, 0, nullptr, nullptr);
+		assert_cl_success(err, "Error reading from buffer");
+
+		_scan<cl_uint>(positions, positions, n, false);
+
+		local_size = _local_size(scatter);
+		_set_args(scatter, in.buffer, flags.buffer, positions, out.buffer, count);
+		_enqueue(scatter, _round_up(n, local_size), local_size);
+
+		cl_uint last_position;
+		err = clEnqueueReadBuffer(util.get_queue(), positions, CL_TRUE, (n - 1) * sizeof(cl_uint), sizeof(cl_uint), &last_position, 0, nullptr, nullptr);
+		assert_cl_success(err, "Error reading from buffer");
+
+		util.release_buffer(positions);
+		return (size_t)last_position + last_flag;
+	}
+
+private:
+	CL_Util& util;
+	bool use_subgroups = false;
+	std::map<std::string, cl_program> programs;
+	std::map<std::string, cl_kernel> kernels;
+
+	static size_t _round_up(size_t value, size_t multiple) {
+		return ((value + multiple - 1) / multiple) * multiple;
+	}
+
+	void _assert_not_empty(size_t n) {
+		if (n == 0) {
+			std::cout << "Error! Cannot reduce an empty buffer" << "\n";
+			exit(1);
+		}
+	}
+
+	template <typename T>
+	static std::string _max_literal() {
+		if (std::numeric_limits<T>::has_infinity)
+			return "INFINITY";
+		return std::to_string(std::numeric_limits<T>::max()) + (std::is_signed<T>::value ? "" : "u");
+	}
+
+	template <typename T>
+	static std::string _min_literal() {
+		if (std::numeric_limits<T>::has_infinity)
+			return "(-INFINITY)";
+		// The most negative int cannot be written as a single literal
+		if (std::is_signed<T>::value)
+			return "(" + std::to_string(std::numeric_limits<T>::min() + 1) + "-1)";
+		return "0u";
+	}
+
+	cl_program _get_program(std::string key, const char* source, std::string options) {
+		auto it = programs.find(key);
+		if (it != programs.end())
+			return it->second;
+
+		cl_int err;
+		size_t source_length = 0;
+		cl_program program = clCreateProgramWithSource(util.get_context(), 1, &source, &source_length, &err);
+		assert_cl_success(err, "Error creating program");
+
+		cl_device_id device_id = util.get_device_id();
+		err = clBuildProgram(program, 1, &device_id, options.c_str(), nullptr, nullptr);
+		assert_program_build_success(program, device_id, err, options);
+
+		programs[key] = program;
+		return program;
+	}
+
+	cl_kernel _get_kernel(std::string program_key, const char* source, std::string options, const char* function_name) {
+		std::string key = program_key + "|" + function_name;
+		auto it = kernels.find(key);
+		if (it != kernels.end())
+			return it->second;
+
+		cl_int err;
+		cl_kernel kernel = clCreateKernel(_get_program(program_key, source, options), function_name, &err);
+		assert_cl_success(err, "Error creating OpenCL kernel");
+
+		kernels[key] = kernel;
+		return kernel;
+	}
+
+	// Largest power of two up to 256 the kernel can run with
+	size_t _local_size(cl_kernel kernel) {
+		size_t max_size;
+		cl_int err = clGetKernelWorkGroupInfo(kernel, util.get_device_id(), CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &max_size, nullptr);
+		assert_cl_success(err, "Error getting OpenCL kernel work group info");
+
+		size_t size = 1;
+		while (size * 2 <= std::min(max_size, (size_t)256))
+			size *= 2;
+		return size;
+	}
+
+	cl_mem _create_temp(size_t size) {
+		return util.create_raw_buffer(size, CL_MEM_READ_WRITE, "CL_Primitives");
+	}
+
+	void _set_arg(cl_kernel kernel, cl_uint index, cl_mem buffer) {
+		cl_int err = clSetKernelArg(kernel, index, sizeof(cl_mem), &buffer);
+		assert_cl_success(err, "Error setting OpenCL kernel arg");
+	}
+
+	template <typename T>
+	void _set_arg(cl_kernel kernel, cl_uint index, T value) {
+		cl_int err = clSetKernelArg(kernel, index, sizeof(T), &value);
+		assert_cl_success(err, "Error setting OpenCL kernel arg");
+	}
+
+	void _set_local_arg(cl_kernel kernel, cl_uint index, size_t size) {
+		cl_int err = clSetKernelArg(kernel, index, size, nullptr);
+		assert_cl_success(err, "Error setting OpenCL kernel arg");
+	}
+
+	template <typename... Args>
+	void _set_args(cl_kernel kernel, Args... args) {
+		cl_uint index = 0;
+		int expand[] = { (_set_arg(kernel, index++, args), 0)... };
+		(void)expand;
+	}
+
+	void _enqueue(cl_kernel kernel, size_t global_size, size_t local_size) {
+		cl_int err = clEnqueueNDRangeKernel(util.get_queue(), kernel, 1, nullptr, &global_size, &local_size, 0, nullptr, nullptr);
+		assert_cl_success(err, "Error enqueuing OpenCL kernel");
+	}
+
+	template <typename T>
+	T _reduce(cl_mem in, size_t n, std::string op, std::string options) {
+		T result;
+		_reduce_raw(in, n, op + "|" + CL_Type_Name<T>::name(), std::string("-D T=") + CL_Type_Name<T>::name() + " " + options, sizeof(T), &result);
+		return result;
+	}
+
+	// One pass with at most local_size groups, then one group combines their partials
+	void _reduce_raw(cl_mem in, size_t n, std::string key, std::string options, size_t result_size, void* result) {
+		if (use_subgroups)
+			options += " -D USE_SUBGROUPS";
+		key = "reduce|" + key;
+		cl_kernel first = _get_kernel(key, cl_reduce_source, options, "reduce_first");
+		cl_kernel next = _get_kernel(key, cl_reduce_source, options, "reduce_next");
+
+		size_t local_size = std::min(_local_size(first), _local_size(next));
+		size_t groups = std::min((n + local_size - 1) / local_size, local_size);
+
+		cl_mem partials = _create_temp(groups * result_size);
+		_set_args(first, in, partials, (cl_uint)n);
+		_set_local_arg(first, 3, local_size * result_size);
+		_enqueue(first, groups * local_size, local_size);
+
+		cl_mem final_result = partials;
+		if (groups > 1) {
+			final_result = _create_temp(result_size);
+			_set_args(next, partials, final_result, (cl_uint)groups);
+			_set_local_arg(next, 3, local_size * result_size);
+			_enqueue(next, local_size, local_size);
+		}
+
+		cl_int err = clEnqueueReadBuffer(util.get_queue(), final_result, CL_TRUE, 0, result_size, result, 0, nullptr, nullptr);
+		assert_cl_success(err, "Error reading from buffer");
+
+		if (final_result != partials)
+			util.release_buffer(final_result);
+		util.release_buffer(partials);
+	}
+
+	template <typename T>
+	void _scan(cl_mem in, cl_mem out, size_t n, bool inclusive) {
+		if (n == 0)
+			return;
+		if (util.is_native()) {
+			T* data = (T*)in;
+			T* result = (T*)out;
+			T sum = 0;
+			for (size_t i = 0; i < n; i++) {
+				T value = data[i];
+				result[i] = inclusive ? sum + value : sum;
+				sum += value;
+			}
+			return;
+		}
+
+		std::string key = std::string("scan|") + CL_Type_Name<T>::name();
+		std::string options = std::string("-D T=") + CL_Type_Name<T>::name();
+		cl_kernel scan_blocks = _get_kernel(key, cl_scan_source, options, "scan_blocks");
+		cl_kernel add_offsets = _get_kernel(key, cl_scan_source, options, "add_block_offsets");
+
+		size_t local_size = std::min(_local_size(scan_blocks), _local_size(add_offsets));
+		size_t block = 2 * local_size;
+		size_t groups = (n + block - 1) / block;
+
+		cl_mem block_sums = _create_temp(groups * sizeof(T));
+		_set_args(scan_blocks, in, out, block_sums, (cl_uint)n, (cl_uint)inclusive);
+		_set_local_arg(scan_blocks, 5, block * sizeof(T));
+		_enqueue(scan_blocks, groups * local_size, local_size);
+
+		// Scan the block totals (recursively for very large inputs) and add them back
+		if (groups > 1) {
+			_scan<T>(block_sums, block_sums, groups, false);
+			_set_args(add_offsets, out, block_sums, (cl_uint)n, (cl_uint)block);
+			_enqueue(add_offsets, _round_up(n, local_size), local_size);
+		}
+
+		clFinish(util.get_queue());
+		util.release_buffer(block_sums);
+	}
+
+	void _radix_sort(cl_mem keys, cl_mem values, size_t n) {
+		if (n < 2)
+			return;
+		if (util.is_native()) {
+			unsigned int* key_data = (unsigned int*)keys;
+			unsigned int* value_data = (unsigned int*)values;
+			std::vector<size_t> order(n);
+			std::iota(order.begin(), order.end(), (size_t)0);
+			std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return key_data[a] < key_data[b]; });
+
+			std::vector<unsigned int> sorted(n);
+			for (size_t i = 0; i < n; i++)
+				sorted[i] = key_data[order[i]];
+			std::copy(sorted.begin(), sorted.end(), key_data);
+			if (value_data) {
+				for (size_t i = 0; i < n; i++)
+					sorted[i] = value_data[order[i]];
+				std::copy(sorted.begin(), sorted.end(), value_data);
+			}
+			return;
+		}
+
+		cl_kernel histogram = _get_kernel("radix", cl_radix_source, "", "radix_histogram");
+		cl_kernel scatter = _get_kernel("radix", cl_radix_source, "", "radix_scatter");
+
+		// Both kernels must agree on the group layout
+		size_t local_size = std::min(_local_size(histogram), _local_size(scatter));
+		size_t groups = (n + local_size - 1) / local_size;
+		size_t global_size = groups * local_size;
+		const size_t radix = 16;
+
+		cl_mem hist = _create_temp(radix * groups * sizeof(cl_uint));
+		cl_mem keys_in = keys, keys_out = _create_temp(n * sizeof(cl_uint));
+		cl_mem values_in = values ? values : keys, values_out = values ? _create_temp(n * sizeof(cl_uint)) : keys_out;
+		cl_mem temp_keys = keys_out, temp_values = values ? values_out : nullptr;
+
+		// Eight passes is even, so the result ends up back in the caller's buffers
+		for (cl_uint shift = 0; shift < 32; shift += 4) {
+			_set_args(histogram, keys_in, (cl_uint)n, shift, hist);
+			_enqueue(histogram, global_size, local_size);
+
+			_scan<cl_uint>(hist, hist, radix * groups, false);
+
+			_set_args(scatter, keys_in, keys_out, values_in, values_out, (cl_uint)(values != nullptr), (cl_uint)n, shift, hist);
+			_set_local_arg(scatter, 8, local_size * radix / 2 * sizeof(cl_uint));
+			_enqueue(scatter, global_size, local_size);
+
+			std::swap(keys_in, keys_out);
+			if (values)
+				std::swap(values_in, values_out);
+			else
+				values_in = values_out = keys_out;
+		}
+		clFinish(util.get_queue());
+
+		util.release_buffer(hist);
+		util.release_buffer(temp_keys);
+		if (temp_values)
+			util.release_buffer(temp_values);
+	}
+
+	void _run_histogram(cl_kernel kernel, cl_mem values, size_t n, cl_mem bins, cl_uint num_bins, std::vector<float> range) {
+		cl_uint zero = 0;
+		cl_int err = clEnqueueFillBuffer(util.get_queue(), bins, &zero, sizeof(zero), 0, num_bins * sizeof(cl_uint), 0, nullptr, nullptr);
+		assert_cl_success(err, "Error filling OpenCL buffer");
+
+		cl_ulong local_mem_size = 0;
+		clGetDeviceInfo(util.get_device_id(), CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem_size), &local_mem_size, nullptr);
+		cl_uint use_local = num_bins * sizeof(cl_uint) <= local_mem_size / 2;
+
+		size_t local_size = _local_size(kernel);
+		size_t groups = std::max((size_t)1, std::min((n + local_size - 1) / local_size, (size_t)256));
+
+		cl_uint index = 0;
+		_set_arg(kernel, index++, values);
+		_set_arg(kernel, index++, (cl_uint)n);
+		for (float bound : range)
+			_set_arg(kernel, index++, bound);
+		_set_arg(kernel, index++, bins);
+		_set_arg(kernel, index++, num_bins);
+		_set_arg(kernel, index++, use_local);
+		_set_local_arg(kernel, index++, use_local ? num_bins * sizeof(cl_uint) : sizeof(cl_uint));
+		_enqueue(kernel, groups * local_size, local_size);
+		clFinish(util.get_queue());
+	}
+};
@@ -0,0 +1,290 @@
+#pragma once
+#include "opencl-util.h"
+#include <new>
+
+// Shared virtual memory: allocations the host and kernels address through the same
+// pointers, so linked structures (lists, trees, quadtrees of Vec2) can be handed to
+// kernels as they are instead of being flattened into buffers.
+//
+// Allocations start mapped for the host. Call unmap_all() before launching kernels
+// that use them and map_all() before the host touches them again; both do nothing for
+// fine-grained memory, which only needs the queue to be finished.
+//
+// Without device SVM, memory falls back to a host allocation wrapped in a
+// CL_MEM_USE_HOST_PTR buffer. That keeps flat arrays working through the same calls, but
+// pointers stored inside the data are only valid on the host then. On the native backend
+// every allocation is plain host memory and pointers work everywhere.
+class CL_SVM {
+public:
+	enum Granularity { COARSE, FINE };
+
+	CL_SVM(CL_Util& util) : util(util) {
+		if (!util.is_native())
+			clGetDeviceInfo(util.get_device_id(), CL_DEVICE_SVM_CAPABILITIES, sizeof(capabilities), &capabilities, nullptr);
+	}
+
+	~CL_SVM() {
+		while (!allocations.empty())
+			release(allocations.begin()->first);
+	}
+
+	CL_SVM(const CL_SVM&) = delete;
+	CL_SVM& operator=(const CL_SVM&) = delete;
+
+	CL_Util& get_util() { return util; }
+	cl_device_svm_capabilities get_capabilities() { return capabilities; }
+
+	bool has_svm() {
+		return util.is_native() || (capabilities & CL_DEVICE_SVM_COARSE_GRAIN_BUFFER);
+	}
+
+	bool has_fine_grain() {
+		return util.is_native() || (capabilities & CL_DEVICE_SVM_FINE_GRAIN_BUFFER);
+	}
+
+	// Fine-grained requests get coarse-grained memory on devices without fine-grained SVM;
+	// get_granularity tells which one was given
+	void* allocate(size_t size, Granularity granularity = COARSE, size_t alignment = 0) {
+		if (size == 0)
+			size = 1;
+		if (alignment < min_alignment)
+			alignment = min_alignment;
+
+		Allocation allocation;
+		allocation.size = size;
+		allocation.alignment = alignment;
+		allocation.granularity = (granularity == FINE && has_fine_grain()) ? FINE : COARSE;
+
+		// Counted in the util's memory budget and leak report like its buffers
+		util.reserve_memory(size, "shared virtual memory");
+
+		void* ptr;
+		if (util.is_native()) {
+			allocation.kind = Allocation::HOST;
+			allocation.granularity = FINE;
+			ptr = ::operator new(size, std::align_val_t(alignment));
+		}
+		else if (has_svm()) {
+			allocation.kind = Allocation::SVM;
+			cl_svm_mem_flags flags = CL_MEM_READ_WRITE;
+			if (allocation.granularity == FINE)
+				flags |= CL_MEM_SVM_FINE_GRAIN_BUFFER;
+
+			ptr = clSVMAlloc(util.get_context(), flags, size, (cl_uint)alignment);
+			if (!ptr && util.get_memory_tracker()->make_room(size, true))
+				ptr = clSVMAlloc(util.get_context(), flags, size, (cl_uint)alignment);
+			if (!ptr) {
+				std::cout << "Error allocating " << size << " bytes of shared virtual memory" << "\n";
+				exit(1);
+			}
+		}
+		else {
+			// Page alignment lets the runtime use the host memory without a copy
+			allocation.kind = Allocation::FALLBACK;
+			allocation.alignment = std::max(alignment, (size_t)4096);
+			ptr = ::operator new(size, std::align_val_t(allocation.alignment));
+
+			cl_int err;
+			allocation.buffer = clCreateBuffer(util.get_context(), CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, size, ptr, &err);
+			assert_cl_success(err, "Error creating OpenCL buffer");
+		}
+
+		allocations[ptr] = allocation;
+		util.track_memory(ptr, size, "CL_SVM");
+		map(ptr);
+		return ptr;
+	}
+
+	template <typename T>
+	T* allocate_array(size_t count, Granularity granularity = COARSE) {
+		return (T*)allocate(count * sizeof(T), granularity, alignof(T));
+	}
+
+	void release(void* ptr) {
+		auto it = allocations.find(ptr);
+		if (it == allocations.end()) {
+			std::cout << "Error! Pointer was not allocated by this CL_SVM" << "\n";
+			exit(1);
+		}
+		Allocation& allocation = it->second;
+		util.untrack_memory(ptr);
+
+		if (allocation.kind == Allocation::SVM) {
+			if (allocation.mapped)
+				unmap(ptr);
+			clFinish(util.get_queue());
+			clSVMFree(util.get_context(), ptr);
+		}
+		else {
+			if (allocation.kind == Allocation::FALLBACK) {
+				if (allocation.mapped)
+					unmap(ptr);
+				clFinish(util.get_queue());
+				clReleaseMemObject(allocation.buffer);
+			}
+			::operator delete(ptr, std::align_val_t(allocation.alignment));
+		}
+		allocations.erase(it);
+	}
+
+	Granularity get_granularity(void* ptr) {
+		return _find(ptr, false).granularity;
+	}
+
+	size_t get_num_allocations() { return allocations.size(); }
+
+	// Host access. Blocking, so kernels already enqueued that use the memory finish first.
+
+	void map(void* ptr, cl_map_flags flags = CL_MAP_READ | CL_MAP_WRITE) {
+		Allocation& allocation = _find(ptr, false);
+		if (allocation.granularity == FINE || allocation.mapped)
+			return;
+
+		cl_int err;
+		if (allocation.kind == Allocation::SVM) {
+			err = clEnqueueSVMMap(util.get_queue(), CL_TRUE, flags, ptr, allocation.size, 0, nullptr, nullptr);
+		}
+		else {
+			// A CL_MEM_USE_HOST_PTR buffer maps back onto the same host memory
+			clEnqueueMapBuffer(util.get_queue(), allocation.buffer, CL_TRUE, flags, 0, allocation.size, 0, nullptr, nullptr, &err);
+		}
+		assert_cl_success(err, "Error mapping shared memory");
+		allocation.mapped = true;
+	}
+
+	void unmap(void* ptr) {
+		Allocation& allocation = _find(ptr, false);
+		if (allocation.granularity == FINE || !allocation.mapped)
+			return;
+
+		cl_int err;
+		if (allocation.kind == Allocation::SVM)
+			err = clEnqueueSVMUnmap(util.get_queue(), ptr, 0, nullptr, nullptr);
+		else
+			err = clEnqueueUnmapMemObject(util.get_queue(), allocation.buffer, ptr, 0, nullptr, nullptr);
+		assert_cl_success(err, "Error unmapping shared memory");
+		allocation.mapped = false;
+	}
+
+	void map_all(cl_map_flags flags = CL_MAP_READ | CL_MAP_WRITE) {
+		for (auto& entry : allocations)
+			map(entry.first, flags);
+	}
+
+	void unmap_all() {
+		for (auto& entry : allocations)
+			unmap(entry.first);
+	}
+
+	// Kernel arguments. Any pointer into an SVM allocation can be bound; fallback memory
+	// can only be bound at the start of an allocation.
+
+	void set_kernel_arg(int index, const void* ptr) {
+		Allocation& allocation = _find(ptr, true);
+		if (allocation.kind == Allocation::FALLBACK)
+			util.set_kernel_arg(index, _fallback_buffer(ptr, allocation));
+		else
+			util.set_kernel_arg_svm(index, ptr);
+	}
+
+	void set_kernel_arg(const void* ptr) {
+		Allocation& allocation = _find(ptr, true);
+		if (allocation.kind == Allocation::FALLBACK)
+			util.set_kernel_arg(_fallback_buffer(ptr, allocation));
+		else
+			util.set_kernel_arg_svm(ptr);
+	}
+
+	// Kernels that follow pointers into allocations other than their arguments (e.g. tree
+	// nodes allocated separately) must be told about them before the launch
+	void set_indirect_pointers() {
+		if (util.is_native() || !has_svm() || allocations.empty())
+			return;
+
+		std::vector<void*> pointers;
+		for (auto& entry : allocations)
+			pointers.push_back(entry.first);
+
+		cl_int err = clSetKernelExecInfo(util.get_kernel(), CL_KERNEL_EXEC_INFO_SVM_PTRS, pointers.size() * sizeof(void*), pointers.data());
+		assert_cl_success(err, "Error setting OpenCL kernel SVM pointers");
+	}
+
+private:
+	struct Allocation {
+		enum Kind { SVM, FALLBACK, HOST };
+
+		Kind kind = SVM;
+		Granularity granularity = COARSE;
+		size_t size = 0;
+		size_t alignment = 0;
+		cl_mem buffer = nullptr;
+		bool mapped = false;
+	};
+
+	static constexpr size_t min_alignment = 128;
+
+	CL_Util& util;
+	cl_device_svm_capabilities capabilities = 0;
+	std::map<void*, Allocation> allocations;
+
+	// Start of the allocation containing ptr, or nullptr
+	void* _base(const void* ptr) {
+		auto it = allocations.upper_bound((void*)ptr);
+		if (it == allocations.begin())
+			return nullptr;
+		it--;
+		if ((const char*)ptr >= (const char*)it->first + it->second.size)
+			return nullptr;
+		return it->first;
+	}
+
+	cl_mem _fallback_buffer(const void* ptr, Allocation& allocation) {
+		if (ptr != _base(ptr)) {
+			std::cout << "Error! Buffers without device SVM can only be bound at the start of the allocation" << "\n";
+			exit(1);
+		}
+		return allocation.buffer;
+	}
+
+	Allocation& _find(const void* ptr, bool allow_interior) {
+		void* base = allow_interior ? _base(ptr) : (void*)ptr;
+		auto it = allocations.find(base);
+		if (it == allocations.end()) {
+			std::cout << "Error! Pointer was not allocated by this CL_SVM" << "\n";
+			exit(1);
+		}
+		return it->second;
+	}
+};
+
+// Allocator placing std containers in shared virtual memory:
+//     std::vector<Node, CL_SVM_Allocator<Node>> nodes(CL_SVM_Allocator<Node>(svm));
+// Fine-grained memory is requested, so the host can keep using the container while kernels
+// are not running without mapping it.
+template <typename T>
+class CL_SVM_Allocator {
+public:
+	typedef T value_type;
+
+	CL_SVM_Allocator(CL_SVM& svm, CL_SVM::Granularity granularity = CL_SVM::FINE) : svm(&svm), granularity(granularity) {}
+
+	template <typename U>
+	CL_SVM_Allocator(const CL_SVM_Allocator<U>& other) : svm(other.svm), granularity(other.granularity) {}
+
+	T* allocate(size_t n) {
+		return (T*)svm->allocate(n * sizeof(T), granularity, alignof(T));
+	}
+
+	void deallocate(T* ptr, size_t) {
+		svm->release(ptr);
+	}
+
+	template <typename U>
+	bool operator==(const CL_SVM_Allocator<U>& other) const { return svm == other.svm; }
+
+	template <typename U>
+	bool operator!=(const CL_SVM_Allocator<U>& other) const { return svm != other.svm; }
+
+	CL_SVM* svm;
+	CL_SVM::Granularity granularity;
+};
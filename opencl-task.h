@@ -0,0 +1,307 @@
+#pragma once
+#include "opencl-util.h"
+
+#if !(__cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L))
+#error "opencl-task.h needs C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <deque>
+
+class CL_Executor;
+
+// One job (e.g. upload, kernel, download for a request) written as a coroutine. Each
+// co_await on a CL_Executor command suspends the job until that command completes, so a
+// single host thread can keep many jobs in flight:
+//     CL_Task job(CL_Executor& executor, CL_Util& util, Request& request) {
+//         co_await executor.write(request.input, request.data, request.size);
+//         util.set_kernel_arg(0, request.input);
+//         co_await executor.launch(request.size, 64);
+//         co_await executor.read(request.input, request.data, request.size);
+//     }
+//     executor.spawn(job(executor, util, request));
+//     executor.run();
+// Jobs only switch at co_await, so setting kernel args right before a launch is safe
+// even though every job shares the CL_Util's kernel.
+class CL_Task {
+public:
+	struct promise_type {
+		cl_command_queue queue = nullptr;
+
+		CL_Task get_return_object() {
+			return CL_Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		// Started by the executor, and destroyed by it once finished
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+
+		void return_void() {}
+
+		void unhandled_exception() {
+			std::cout << "Error! Unhandled exception in CL_Task" << "\n";
+			exit(1);
+		}
+	};
+
+	typedef std::coroutine_handle<promise_type> Handle;
+
+	CL_Task(CL_Task&& other) noexcept : handle(other.handle) {
+		other.handle = nullptr;
+	}
+
+	CL_Task(const CL_Task&) = delete;
+	CL_Task& operator=(const CL_Task&) = delete;
+
+	~CL_Task() {
+		if (handle)
+			handle.destroy();
+	}
+
+	Handle release() {
+		Handle released = handle;
+		handle = nullptr;
+		return released;
+	}
+
+private:
+	Handle handle;
+
+	explicit CL_Task(Handle handle) : handle(handle) {}
+};
+
+// Awaitable for one enqueued command. The enqueue function runs on the job's queue and
+// the job is resumed by the executor once the command's event completes. On the native
+// backend the command runs synchronously and the job never suspends.
+template <typename Enqueue>
+class CL_Command_Awaiter {
+public:
+	CL_Command_Awaiter(CL_Executor& executor, Enqueue enqueue) : executor(executor), enqueue(enqueue) {}
+
+	// Also runs when a job is destroyed while suspended on the command
+	~CL_Command_Awaiter() {
+		if (event)
+			clReleaseEvent(event);
+	}
+
+	bool await_ready() { return false; }
+
+	bool await_suspend(CL_Task::Handle handle);
+
+	void await_resume();
+
+private:
+	friend class CL_Executor;
+
+	CL_Executor& executor;
+	Enqueue enqueue;
+	CL_Task::Handle handle;
+	cl_event event = nullptr;
+	cl_int status = CL_SUCCESS;
+	bool suspended = false;
+};
+
+// Runs CL_Tasks on the calling thread. Event callbacks only queue the job for resumption;
+// run() resumes it on the host thread, so no OpenCL calls happen inside callbacks. Jobs
+// are spread round-robin over a few in-order queues so transfers and kernels of different
+// jobs can overlap.
+class CL_Executor {
+public:
+	CL_Executor(CL_Util& util, int num_queues = 4) : util(util) {
+		if (util.is_native())
+			return;
+		for (int i = 0; i < std::max(num_queues, 1); i++) {
+			cl_int err;
+			cl_command_queue queue = clCreateCommandQueueWithProperties(util.get_context(), util.get_device_id(), 0, &err);
+			assert_cl_success(err, "Error creating OpenCL command queue");
+			queues.push_back(queue);
+		}
+	}
+
+	// Jobs that never finished are destroyed, but only after every event callback has run,
+	// since clFinish can return before the callbacks of the finished commands have run
+	~CL_Executor() {
+		for (auto& queue : queues)
+			clFinish(queue);
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [this] { return pending_callbacks == 0; });
+		}
+		for (auto& handle : tasks)
+			handle.destroy();
+		for (auto& queue : queues)
+			clReleaseCommandQueue(queue);
+	}
+
+	CL_Executor(const CL_Executor&) = delete;
+	CL_Executor& operator=(const CL_Executor&) = delete;
+
+	void spawn(CL_Task task) {
+		CL_Task::Handle handle = task.release();
+		if (!queues.empty())
+			handle.promise().queue = queues[next_queue++ % queues.size()];
+		tasks.push_back(handle);
+		_schedule(handle);
+	}
+
+	// Resumes jobs as their commands complete until every spawned job has finished
+	void run() {
+		std::deque<CL_Task::Handle> resumable;
+		while (!tasks.empty()) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				if (ready.empty()) {
+					lock.unlock();
+					// Callbacks only fire for commands that were submitted
+					for (auto& queue : queues)
+						clFlush(queue);
+					lock.lock();
+					wake.wait(lock, [this] { return !ready.empty(); });
+				}
+				resumable.swap(ready);
+			}
+
+			for (auto& handle : resumable) {
+				handle.resume();
+				if (handle.done()) {
+					handle.destroy();
+					tasks.erase(std::find(tasks.begin(), tasks.end(), handle));
+					num_completed++;
+				}
+			}
+			resumable.clear();
+		}
+	}
+
+	// Awaitable commands
+
+	auto write(CL_Buffer buffer, const void* data, size_t size) {
+		return _command([this, buffer, data, size](cl_command_queue queue, cl_event* event) -> cl_int {
+			if (!queue) {
+				util.write_to_buffer(buffer.buffer, size, data);
+				return CL_SUCCESS;
+			}
+			return clEnqueueWriteBuffer(queue, buffer.buffer, CL_FALSE, 0, size, data, 0, nullptr, event);
+		});
+	}
+
+	auto write(CL_Buffer buffer, const void* data) {
+		return write(buffer, data, buffer.size);
+	}
+
+	auto read(CL_Buffer buffer, void* data, size_t size) {
+		return _command([this, buffer, data, size](cl_command_queue queue, cl_event* event) -> cl_int {
+			if (!queue) {
+				util.read_from_buffer(data, size, buffer.buffer);
+				return CL_SUCCESS;
+			}
+			return clEnqueueReadBuffer(queue, buffer.buffer, CL_FALSE, 0, size, data, 0, nullptr, event);
+		});
+	}
+
+	auto read(CL_Buffer buffer, void* data) {
+		return read(buffer, data, buffer.size);
+	}
+
+	// Launches the CL_Util's current kernel with the arguments set on it so far
+	auto launch(std::vector<size_t> global_size, std::vector<size_t> local_size = {}) {
+		return _command([this, global_size, local_size](cl_command_queue queue, cl_event* event) -> cl_int {
+			if (!queue) {
+				util.run_kernel_nd(global_size, local_size);
+				return CL_SUCCESS;
+			}
+			return clEnqueueNDRangeKernel(queue, util.get_kernel(), (cl_uint)global_size.size(), nullptr, global_size.data(),
+				local_size.empty() ? nullptr : local_size.data(), 0, nullptr, event);
+		});
+	}
+
+	auto launch(size_t global_size, size_t local_size = 0) {
+		return launch(std::vector<size_t>{ global_size }, local_size ? std::vector<size_t>{ local_size } : std::vector<size_t>());
+	}
+
+	int get_num_tasks() { return (int)tasks.size(); }
+	long long get_num_completed() { return num_completed; }
+
+	// Most jobs waiting on the device at once
+	int get_max_in_flight() { return max_in_flight; }
+
+private:
+	template <typename Enqueue>
+	friend class CL_Command_Awaiter;
+
+	CL_Util& util;
+	std::vector<cl_command_queue> queues;
+	size_t next_queue = 0;
+
+	std::vector<CL_Task::Handle> tasks;
+	long long num_completed = 0;
+	int in_flight = 0;
+	int max_in_flight = 0;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::deque<CL_Task::Handle> ready;
+	int pending_callbacks = 0;
+
+	template <typename Enqueue>
+	CL_Command_Awaiter<Enqueue> _command(Enqueue enqueue) {
+		return CL_Command_Awaiter<Enqueue>(*this, enqueue);
+	}
+
+	// Notifies under the lock so run() cannot return and destroy the executor in between
+	void _schedule(CL_Task::Handle handle) {
+		std::lock_guard<std::mutex> lock(mutex);
+		ready.push_back(handle);
+		wake.notify_one();
+	}
+
+	// Nothing touches the executor or the awaiter after the lock is released, so the
+	// destructor can go ahead as soon as the count reaches zero
+	template <typename Enqueue>
+	static void CL_CALLBACK _on_complete(cl_event event, cl_int status, void* user_data) {
+		CL_Command_Awaiter<Enqueue>* awaiter = (CL_Command_Awaiter<Enqueue>*)user_data;
+		awaiter->status = status;
+
+		CL_Executor& executor = awaiter->executor;
+		std::lock_guard<std::mutex> lock(executor.mutex);
+		executor.ready.push_back(awaiter->handle);
+		executor.pending_callbacks--;
+		executor.wake.notify_all();
+	}
+};
+
+template <typename Enqueue>
+bool CL_Command_Awaiter<Enqueue>::await_suspend(CL_Task::Handle _handle) {
+	handle = _handle;
+	cl_command_queue queue = handle.promise().queue;
+
+	status = enqueue(queue, &event);
+	if (!queue || status != CL_SUCCESS)
+		return false;
+
+	// The awaiter lives in the suspended coroutine frame until the callback resumes it. The
+	// callback may already have fired, so status is left to it.
+	{
+		std::lock_guard<std::mutex> lock(executor.mutex);
+		executor.pending_callbacks++;
+	}
+	cl_int err = clSetEventCallback(event, CL_COMPLETE, CL_Executor::_on_complete<Enqueue>, this);
+	if (err != CL_SUCCESS) {
+		std::lock_guard<std::mutex> lock(executor.mutex);
+		executor.pending_callbacks--;
+		status = err;
+		return false;
+	}
+
+	suspended = true;
+	executor.in_flight++;
+	executor.max_in_flight = std::max(executor.max_in_flight, executor.in_flight);
+	return true;
+}
+
+template <typename Enqueue>
+void CL_Command_Awaiter<Enqueue>::await_resume() {
+	if (suspended)
+		executor.in_flight--;
+	assert_cl_success(status, "Error in awaited OpenCL command");
+}
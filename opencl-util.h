@@ -7,6 +7,19 @@
 #include <sstream>
 #include <string>
 #include <typeinfo>
+#include <algorithm>
+#include <map>
+#include <chrono>
+#include <array>
+#include <limits>
+#include <type_traits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <future>
+#include "native-util.h"
 
 bool ext_list_contains_ext(std::string ext, std::string str) {
 	size_t old_pos = 0;
@@ -135,6 +148,105 @@ static std::string read_file(const char* fileName) {
 	return std::move(res);
 }
 
+// OpenCL C spelling of a host type, for building kernels specialized on it
+template <typename T> struct CL_Type_Name;
+template <> struct CL_Type_Name<float> { static const char* name() { return "float"; } };
+template <> struct CL_Type_Name<double> { static const char* name() { return "double"; } };
+template <> struct CL_Type_Name<int> { static const char* name() { return "int"; } };
+template <> struct CL_Type_Name<unsigned int> { static const char* name() { return "uint"; } };
+template <> struct CL_Type_Name<long long> { static const char* name() { return "long"; } };
+template <> struct CL_Type_Name<unsigned long long> { static const char* name() { return "ulong"; } };
+template <> struct CL_Type_Name<short> { static const char* name() { return "short"; } };
+template <> struct CL_Type_Name<unsigned short> { static const char* name() { return "ushort"; } };
+template <> struct CL_Type_Name<char> { static const char* name() { return "char"; } };
+template <> struct CL_Type_Name<unsigned char> { static const char* name() { return "uchar"; } };
+
+// Builds the options string passed to clBuildProgram. Defines turn host values into
+// compile-time constants, so a kernel can be specialized on sizes, types or unroll
+// factors instead of reading them from arguments:
+//     CL_Build_Options().define("TILE", 16).define_type<float>("T").fast_relaxed_math()
+class CL_Build_Options {
+public:
+	CL_Build_Options() {}
+
+	CL_Build_Options(std::string options) : options(options) {}
+
+	CL_Build_Options(const char* options) : options(options) {}
+
+	CL_Build_Options& define(std::string name) {
+		return add("-D " + name);
+	}
+
+	template <typename T>
+	CL_Build_Options& define(std::string name, T value) {
+		return add("-D " + name + "=" + _literal(value));
+	}
+
+	// -D name=<OpenCL C type of T>
+	template <typename T>
+	CL_Build_Options& define_type(std::string name) {
+		return add("-D " + name + "=" + CL_Type_Name<T>::name());
+	}
+
+	// Defines each name to the matching template argument:
+	//     CL_Build_Options::constants<16, 4>({ "TILE", "UNROLL" })
+	template <auto... Values>
+	static CL_Build_Options constants(std::array<const char*, sizeof...(Values)> names) {
+		CL_Build_Options result;
+		int i = 0;
+		(result.define(names[i++], Values), ...);
+		return result;
+	}
+
+	CL_Build_Options& fast_relaxed_math() {
+		return add("-cl-fast-relaxed-math");
+	}
+
+	CL_Build_Options& mad_enable() {
+		return add("-cl-mad-enable");
+	}
+
+	CL_Build_Options& cl_std(std::string version) {
+		return add("-cl-std=" + version);
+	}
+
+	CL_Build_Options& add(std::string option) {
+		if (!option.empty())
+			options += (options.empty() ? "" : " ") + option;
+		return *this;
+	}
+
+	const std::string& str() const { return options; }
+	const char* c_str() const { return options.c_str(); }
+
+private:
+	std::string options;
+
+	// Floats keep every digit and get an f suffix so the kernel doesn't promote to double
+	template <typename T>
+	static std::string _literal(T value) {
+		if constexpr (std::is_same<T, bool>::value) {
+			return value ? "1" : "0";
+		}
+		else if constexpr (std::is_floating_point<T>::value) {
+			std::ostringstream stream;
+			stream << std::setprecision(std::numeric_limits<T>::max_digits10) << value;
+			std::string literal = stream.str();
+			if (literal.find_first_of(".e") == std::string::npos)
+				literal += ".0";
+			if (std::is_same<T, float>::value)
+				literal += "f";
+			return literal;
+		}
+		else if constexpr (std::is_integral<T>::value) {
+			return std::to_string(value) + (std::is_unsigned<T>::value ? "u" : "");
+		}
+		else {
+			return std::string(value);
+		}
+	}
+};
+
 void assert_cl_success(const cl_int err, const char* message) {
 	if (err) {
 		std::string error_message = std::string(message);
@@ -146,6 +258,28 @@ void assert_cl_success(const cl_int err, const char* message) {
 	}
 }
 
+// Prints the options and build log for a failed clBuildProgram and exits
+void assert_program_build_success(cl_program program, cl_device_id device_id, const cl_int err, const std::string& options = "") {
+	if (err) {
+		std::cout << "Error building OpenCL program\n\tCode: " << err << "\n";
+		if (!options.empty())
+			std::cout << "\tOptions: " << options << "\n";
+		std::cout << "\n";
+
+		size_t log_length;
+		cl_int info_err = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, 0, nullptr, &log_length);
+		assert_cl_success(info_err, "Error getting OpenCL program build info");
+
+		std::string log(log_length, '\0');
+		info_err = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, log_length, &log[0], nullptr);
+		assert_cl_success(info_err, "Error getting OpenCL program build info");
+
+		std::cout << log << "\n";
+
+		exit(1);
+	}
+}
+
 struct CL_Attribute {
 	std::string name;
 	void* raw_value;
@@ -242,6 +376,35 @@ public:
 		return false;
 	}
 
+	// Splits the device into as many sub-devices as possible with units_per_device compute units each
+	std::vector<CL_Device> partition_equally(cl_uint units_per_device) {
+		cl_device_partition_property props[] = { CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)units_per_device, 0 };
+		return _partition(props);
+	}
+
+	// One sub-device per entry, each with the given number of compute units
+	std::vector<CL_Device> partition_by_counts(std::vector<cl_uint> counts) {
+		std::vector<cl_device_partition_property> props{ CL_DEVICE_PARTITION_BY_COUNTS };
+		for (auto count : counts)
+			props.push_back((cl_device_partition_property)count);
+		props.push_back(CL_DEVICE_PARTITION_BY_COUNTS_LIST_END);
+		props.push_back(0);
+		return _partition(props.data());
+	}
+
+	// One sub-device per NUMA node / shared cache, e.g. CL_DEVICE_AFFINITY_DOMAIN_NUMA
+	std::vector<CL_Device> partition_by_affinity_domain(cl_device_affinity_domain domain = CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE) {
+		cl_device_partition_property props[] = { CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, (cl_device_partition_property)domain, 0 };
+		return _partition(props);
+	}
+
+	cl_uint get_max_sub_devices() {
+		cl_uint max_sub_devices = 0;
+		err = clGetDeviceInfo(id, CL_DEVICE_PARTITION_MAX_SUB_DEVICES, sizeof(cl_uint), &max_sub_devices, nullptr);
+		assert_cl_success(err, "Error getting device partition info");
+		return max_sub_devices;
+	}
+
 private:
 	std::vector<CL_Attribute> attributes;
 
@@ -251,6 +414,21 @@ private:
 	std::vector<std::string> attr_names{ "Name", "Device Version", "Driver Version", "Parallel Computing Units", "Max Clock Frequency", "Max Constant Buffer Size"};
 	std::vector<cl_device_info> attr_types{ CL_DEVICE_NAME, CL_DEVICE_VERSION,
 		CL_DRIVER_VERSION, CL_DEVICE_MAX_COMPUTE_UNITS, CL_DEVICE_MAX_CLOCK_FREQUENCY, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE };
+
+	std::vector<CL_Device> _partition(const cl_device_partition_property* props) {
+		cl_uint num_sub_devices = 0;
+		err = clCreateSubDevices(id, props, 0, nullptr, &num_sub_devices);
+		assert_cl_success(err, "Error getting number of OpenCL sub-devices");
+
+		std::vector<cl_device_id> sub_device_ids(num_sub_devices);
+		err = clCreateSubDevices(id, props, num_sub_devices, sub_device_ids.data(), nullptr);
+		assert_cl_success(err, "Error creating OpenCL sub-devices");
+
+		std::vector<CL_Device> sub_devices;
+		for (auto& sub_device_id : sub_device_ids)
+			sub_devices.push_back(CL_Device(sub_device_id));
+		return sub_devices;
+	}
 };
 
 class CL_Platform {
@@ -358,10 +536,12 @@ class CL_Hardware_Info {
 public:
 	cl_int err;
 	cl_device_id device_to_use;
+	std::vector<cl_device_id> devices_to_use;
 
 	CL_Hardware_Info() {
 		err = 0;
 		device_to_use = NULL;
+		devices_to_use = {};
 		required_extensions = {};
 		num_platforms = 0;
 		platforms = {};
@@ -372,6 +552,42 @@ public:
 		init();
 	}
 
+	std::vector<CL_Platform> get_platforms() {
+		return platforms;
+	}
+
+	// True if an OpenCL ICD is installed and exposes at least one device
+	static bool opencl_available() {
+		cl_uint num_platforms = 0;
+		if (clGetPlatformIDs(0, NULL, &num_platforms) != CL_SUCCESS || num_platforms == 0)
+			return false;
+
+		std::vector<cl_platform_id> platform_ids(num_platforms);
+		if (clGetPlatformIDs(num_platforms, platform_ids.data(), NULL) != CL_SUCCESS)
+			return false;
+
+		for (auto& platform_id : platform_ids) {
+			cl_uint num_devices = 0;
+			if (clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_ALL, 0, NULL, &num_devices) == CL_SUCCESS && num_devices > 0)
+				return true;
+		}
+		return false;
+	}
+
+	// Sub-devices of the chosen device, so separate workloads can run on disjoint cores
+
+	std::vector<cl_device_id> partition_equally(cl_uint units_per_device) {
+		return _sub_device_ids(CL_Device(device_to_use).partition_equally(units_per_device));
+	}
+
+	std::vector<cl_device_id> partition_by_counts(std::vector<cl_uint> counts) {
+		return _sub_device_ids(CL_Device(device_to_use).partition_by_counts(counts));
+	}
+
+	std::vector<cl_device_id> partition_by_affinity_domain(cl_device_affinity_domain domain = CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE) {
+		return _sub_device_ids(CL_Device(device_to_use).partition_by_affinity_domain(domain));
+	}
+
 private:
 	std::vector<std::string> required_extensions;
 	cl_uint num_platforms;
@@ -434,6 +650,19 @@ private:
 		CL_Device chosen_device = valid_devices[0];
 		device_to_use = chosen_device.get_id();
 		std::cout << "Chosen Device: " << chosen_device.attribute_desc<char*>("Name") << std::endl;
+
+		// Every matching device is kept so multi-device utilities can use all of them
+		devices_to_use.clear();
+		for (auto& device : valid_devices) {
+			devices_to_use.push_back(device.get_id());
+		}
+	}
+
+	std::vector<cl_device_id> _sub_device_ids(std::vector<CL_Device> sub_devices) {
+		std::vector<cl_device_id> ids;
+		for (auto& device : sub_devices)
+			ids.push_back(device.get_id());
+		return ids;
 	}
 
 	cl_uint _get_num_platforms() {
@@ -454,187 +683,810 @@ private:
 	}
 };
 
-class CL_Kernel {
-public:
-	CL_Kernel(CL_Program program, const char* function_name): program(program), function_name(function_name) {
-		cl_int err;
 
-		cl_kernel _kernel = clCreateKernel(program.get_program(), function_name, &err);
-		assert_cl_success(err, "Error creating OpenCL kernel");
+template <typename T> class CL_Vector;
+
+// One program building in the background. Finished by the clBuildProgram callback, or
+// directly when the build could not be started.
+struct CL_Async_Build {
+	std::string name;
+	std::string options;
+	cl_device_id device_id = nullptr;
+	cl_program program = nullptr;
+
+	std::chrono::high_resolution_clock::time_point start;
+	double build_ms = 0;
+	cl_int status = CL_SUCCESS;
+	bool done = false;
 
-		kernel = kernel;
+	// Set by the build callback, so a failed clBuildProgram knows whether the callback
+	// already ran and freed its user data
+	bool callback_ran = false;
+
+	std::mutex mutex;
+	std::condition_variable finished;
+
+	void finish(cl_int result) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (done)
+			return;
+		build_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		status = result;
+		done = true;
+		finished.notify_all();
 	}
 
-	const char* get_function_name() {
-		return function_name;
+	void wait() {
+		std::unique_lock<std::mutex> lock(mutex);
+		finished.wait(lock, [this] { return done; });
 	}
 
-private:
-	CL_Program program;
-	const char* function_name;
-	cl_kernel kernel;
+	bool ready() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return done;
+	}
 };
 
-class CL_Program {
+// Threads for asynchronous program builds. A thread is added whenever a job is submitted
+// and every thread is busy, up to one per hardware thread, so that many builds run at once
+// even on drivers whose clBuildProgram blocks. Jobs still queued when it is destroyed run
+// before the threads exit.
+class CL_Build_Pool {
 public:
-	CL_Program(const char* filename, CL_Context context): context(context) {
-		cl_int err;
+	// 0 allows one thread per hardware thread
+	CL_Build_Pool(size_t max_threads = 0) : max_threads(max_threads ? max_threads : std::max(1u, std::thread::hardware_concurrency())) {}
 
-		std::string s = read_file(filename);
-		const char* program_source = s.c_str();
-		size_t source_length = 0;
+	~CL_Build_Pool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& thread : threads)
+			thread.join();
+	}
 
-		cl_program _program = clCreateProgramWithSource(context.get_context(), 1, &program_source, &source_length, &err);
-		assert_cl_success(err, "Error creating program");
+	CL_Build_Pool(const CL_Build_Pool&) = delete;
+	CL_Build_Pool& operator=(const CL_Build_Pool&) = delete;
 
-		program = _program;
+	void submit(std::function<void()> job) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			jobs.push_back(job);
+			if (idle < jobs.size() && threads.size() < max_threads)
+				threads.emplace_back(&CL_Build_Pool::_loop, this);
+		}
+		wake.notify_one();
+	}
 
-		build_program();
+	size_t get_num_threads() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return threads.size();
 	}
 
-	void build_program() {
-		;
-		cl_int err = clBuildProgram(program, 1, (const cl_device_id*)context.get_device_id(), "", nullptr, nullptr);
+private:
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::deque<std::function<void()>> jobs;
+	std::vector<std::thread> threads;
+	size_t max_threads;
+	size_t idle = 0;
+	bool stopping = false;
+
+	void _loop() {
+		while (true) {
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				idle++;
+				wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+				idle--;
+				if (jobs.empty())
+					return;
+				job = jobs.front();
+				jobs.pop_front();
+			}
+			job();
+		}
+	}
+};
 
-		if (err) {
-			std::cout << "Error building OpenCL program\n\tCode: " << err << "\n\n";
+struct CL_Buffer {
+	cl_mem buffer;
+	size_t size;
 
-			cl_int info_err;
+	CL_Buffer(cl_mem buffer, size_t size) : buffer(buffer), size(size) {
+		
+	};
+};
 
-			char* log;
-			size_t log_length;
-			
-			info_err = clGetProgramBuildInfo(program, context.get_device_id(), CL_PROGRAM_BUILD_LOG, 0, nullptr, &log_length);
+// Device memory allocated through a CL_Util or a session: live bytes, peak and a
+// breakdown by tag. A CL_Util attached to a session also counts its buffers in the
+// session's tracker, and a budget on either one limits both.
+//
+// When an allocation would go over budget the trim callbacks are asked to free memory
+// first (e.g. cached scratch buffers). Buffers still alive when the last owner of a
+// tracker goes away are reported if CL_UTIL_REPORT_LEAKS=1 or set_report_leaks(true).
+class CL_Memory_Tracker : public std::enable_shared_from_this<CL_Memory_Tracker> {
+public:
+	struct Tag_Usage {
+		size_t bytes = 0;
+		size_t peak = 0;
+		size_t count = 0;
+	};
 
-			log = (char*)malloc(log_length);
+	CL_Memory_Tracker(std::string name) : name(name) {
+		const char* report = getenv("CL_UTIL_REPORT_LEAKS");
+		report_leaks = report && std::string(report) != "0";
+	}
 
-			info_err = clGetProgramBuildInfo(program, context.get_device_id(), CL_PROGRAM_BUILD_LOG, log_length, log, nullptr);
+	// Buffers of a tracker with a parent are reported by the parent instead
+	~CL_Memory_Tracker() {
+		if (report_leaks && !parent && !buffers.empty())
+			print_leaks();
+	}
 
-			assert_cl_success(info_err, "Error getting OpenCL program build info");
+	CL_Memory_Tracker(const CL_Memory_Tracker&) = delete;
+	CL_Memory_Tracker& operator=(const CL_Memory_Tracker&) = delete;
 
-			std::cout << log << "\n";
+	void set_parent(std::shared_ptr<CL_Memory_Tracker> _parent) {
+		std::lock_guard<std::mutex> lock(mutex);
+		parent = _parent;
+	}
 
-			exit(1);
-		}
+	void set_report_leaks(bool report) {
+		std::lock_guard<std::mutex> lock(mutex);
+		report_leaks = report;
 	}
 
-	cl_program get_program() {
-		return program;
+	// 0 turns the budget off
+	void set_budget(size_t bytes) {
+		std::lock_guard<std::mutex> lock(mutex);
+		budget = bytes;
 	}
-private:
-	cl_program program;
-	CL_Context context;
-};
 
-class CL_Context {
-public:
-	std::vector<CL_Program> programs;
+	size_t get_budget() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return budget;
+	}
 
-	CL_Context(cl_device_id device_id, cl_context_properties* props): device_id(device_id), props(props) {
-		make();
+	// Bytes that can still be allocated under this budget and the parent's
+	size_t get_available() {
+		std::shared_ptr<CL_Memory_Tracker> next;
+		size_t available = std::numeric_limits<size_t>::max();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (budget)
+				available = budget > used ? budget - used : 0;
+			next = parent;
+		}
+		return next ? std::min(available, next->get_available()) : available;
 	}
 
-	void update_props(cl_context_properties* _props, bool should_remake = true) {
-		props = _props;
-		if (should_remake)
-			make();
+	void add(cl_mem buffer, size_t size, const std::string& tag) {
+		_add(buffer, size, tag, std::weak_ptr<CL_Memory_Tracker>());
 	}
 
-	void change_device(cl_device_id id, bool should_remake = true) {
-		device_id = id;
-		if (should_remake)
-			make();
+	// Also removes the buffer from the parents and from whichever child tracker added it,
+	// so one CL_Util can release a buffer another one in the same session created.
+	// False if none of them knew the buffer.
+	bool remove(cl_mem buffer) {
+		bool removed = _remove_with_owners(buffer);
+		for (auto next = _get_parent(); next; next = next->_get_parent())
+			removed = next->_remove_with_owners(buffer) || removed;
+		return removed;
 	}
 
-	void make() {
-		create_context();
-		create_queue();
+	// trim(bytes still needed) frees what it can and returns the number of bytes freed.
+	// The id removes the callback again; remove it before whatever it frees is destroyed.
+	int add_trim_callback(std::function<size_t(size_t)> trim) {
+		std::lock_guard<std::mutex> lock(mutex);
+		trim_callbacks[next_trim_id] = trim;
+		return next_trim_id++;
 	}
 
-	void create_context() {
-		cl_int err;
+	void remove_trim_callback(int id) {
+		std::lock_guard<std::mutex> lock(mutex);
+		trim_callbacks.erase(id);
+	}
 
-		cl_context _context = clCreateContext((const cl_context_properties*)props, 1, &device_id, nullptr, nullptr, &err);
-		assert_cl_success(err, "Error creating OpenCL context");
-		context = _context;
+	// Runs trim callbacks, own ones first, until size bytes fit. Also used after the
+	// device itself refused an allocation, with force set since the budget may not be hit.
+	bool make_room(size_t size, bool force = false) {
+		if (!force && size <= get_available())
+			return true;
+
+		std::vector<std::function<size_t(size_t)>> callbacks;
+		std::shared_ptr<CL_Memory_Tracker> next;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto& entry : trim_callbacks)
+				callbacks.push_back(entry.second);
+			next = parent;
+		}
+
+		// Callbacks release through the tracker, so no lock is held while they run
+		size_t freed = 0;
+		for (auto& trim : callbacks) {
+			if (force ? freed >= size : size <= get_available())
+				return true;
+			freed += trim(force ? size - freed : size - std::min(size, get_available()));
+		}
+
+		// Within budget only if the parent made room and this tracker's own budget fits too
+		bool parent_made_room = next && next->make_room(size, force);
+		if (force)
+			return freed >= size || parent_made_room;
+		return (!next || parent_made_room) && size <= get_available();
 	}
 
-	void create_queue() {
+	// clCreateBuffer counted by this tracker. Trim callbacks run when the budget is short,
+	// and once more if the device refuses the allocation. Null when neither has room;
+	// other errors exit.
+	cl_mem create_buffer(cl_context context, size_t size, cl_mem_flags flags, const std::string& tag) {
+		if (!make_room(size))
+			return nullptr;
+
 		cl_int err;
+		cl_mem buffer = clCreateBuffer(context, flags, size, nullptr, &err);
+		if (is_allocation_failure(err) && make_room(size, true))
+			buffer = clCreateBuffer(context, flags, size, nullptr, &err);
+		if (is_allocation_failure(err))
+			return nullptr;
+		if (err == CL_INVALID_BUFFER_SIZE)
+			std::cout << "Error! Invalid OpenCL buffer size: " << size << " bytes" << "\n";
+		assert_cl_success(err, "Error creating OpenCL buffer");
 
-		cl_command_queue _queue = clCreateCommandQueueWithProperties(context, device_id, 0, &err);
-		assert_cl_success(err, "Error creating OpenCL command queue");
-		queue = _queue;
+		add(buffer, size, tag);
+		return buffer;
 	}
 
-	void create_program(const char* function_name) {
-		//programs.push_back(CL_Program(function_name, *this));
+	// For allocations that found no room: prints what failed with this tracker's report and exits
+	void fail_allocation(const std::string& what, size_t size) {
+		std::cout << "Error creating " << what << " of " << convertToGoodNumber((double)size) << ": out of device memory or over the memory budget" << "\n";
+		print_report();
+		exit(1);
 	}
 
-	cl_device_id get_device_id() {
-		return device_id;
+	// Only errors that freeing other buffers can fix
+	static bool is_allocation_failure(cl_int err) {
+		return err == CL_MEM_OBJECT_ALLOCATION_FAILURE || err == CL_OUT_OF_RESOURCES;
 	}
 
-	cl_context_properties* get_properties() {
-		return props;
+	const std::string& get_name() { return name; }
+
+	size_t get_used() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return used;
 	}
 
-	cl_context get_context() {
-		return context;
+	size_t get_peak() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return peak;
 	}
 
-	cl_command_queue get_command_queue() {
-		return queue;
+	size_t get_num_buffers() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return buffers.size();
+	}
+
+	std::map<std::string, Tag_Usage> get_usage_by_tag() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return tags;
+	}
+
+	void reset_peak() {
+		std::lock_guard<std::mutex> lock(mutex);
+		peak = used;
+		for (auto& entry : tags)
+			entry.second.peak = entry.second.bytes;
+	}
+
+	void print_report() {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::cout << "Device memory (" << name << "): " << convertToGoodNumber((double)used) << " in " << buffers.size() << " buffers, peak " << convertToGoodNumber((double)peak);
+		if (budget)
+			std::cout << ", budget " << convertToGoodNumber((double)budget);
+		std::cout << "\n";
+		for (auto& entry : tags)
+			std::cout << "\t" << entry.first << ": " << convertToGoodNumber((double)entry.second.bytes) << " in " << entry.second.count << " buffers, peak " << convertToGoodNumber((double)entry.second.peak) << "\n";
+	}
+
+	void print_leaks() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (buffers.empty())
+			return;
+		std::cout << "Leaked device memory (" << name << "): " << convertToGoodNumber((double)used) << " in " << buffers.size() << " buffers\n";
+		for (auto& entry : tags) {
+			if (entry.second.count)
+				std::cout << "\t" << entry.first << ": " << convertToGoodNumber((double)entry.second.bytes) << " in " << entry.second.count << " buffers\n";
+		}
 	}
 
 private:
-	cl_device_id device_id;
-	cl_context_properties* props;
-	cl_context context;
-	cl_command_queue queue;
+	std::string name;
+	std::shared_ptr<CL_Memory_Tracker> parent;
+	bool report_leaks = false;
 
+	size_t budget = 0;
+	size_t used = 0;
+	size_t peak = 0;
+	std::map<cl_mem, std::pair<size_t, std::string>> buffers;
+	// Child tracker that added each buffer, for removals that start somewhere else
+	std::map<cl_mem, std::weak_ptr<CL_Memory_Tracker>> owners;
+	std::map<std::string, Tag_Usage> tags;
 
-};
+	std::map<int, std::function<size_t(size_t)>> trim_callbacks;
+	int next_trim_id = 0;
 
-struct CL_Buffer {
-	cl_mem buffer;
-	size_t size;
+	std::mutex mutex;
 
-	CL_Buffer(cl_mem buffer, size_t size) : buffer(buffer), size(size) {
-		
-	};
+	void _add(cl_mem buffer, size_t size, const std::string& tag, std::weak_ptr<CL_Memory_Tracker> owner) {
+		std::shared_ptr<CL_Memory_Tracker> next;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			buffers[buffer] = std::make_pair(size, tag);
+			if (!owner.expired())
+				owners[buffer] = owner;
+			used += size;
+			peak = std::max(peak, used);
+
+			Tag_Usage& usage = tags[tag];
+			usage.bytes += size;
+			usage.peak = std::max(usage.peak, usage.bytes);
+			usage.count++;
+			next = parent;
+		}
+		if (next)
+			next->_add(buffer, size, tag, weak_from_this());
+	}
+
+	// Removes the buffer here and in the child that added it, but not in the parents
+	bool _remove_with_owners(cl_mem buffer) {
+		std::shared_ptr<CL_Memory_Tracker> owner;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = buffers.find(buffer);
+			if (it == buffers.end())
+				return false;
+			used -= it->second.first;
+
+			Tag_Usage& usage = tags[it->second.second];
+			usage.bytes -= it->second.first;
+			usage.count--;
+			buffers.erase(it);
+
+			auto owner_it = owners.find(buffer);
+			if (owner_it != owners.end()) {
+				owner = owner_it->second.lock();
+				owners.erase(owner_it);
+			}
+		}
+		if (owner)
+			owner->_remove_with_owners(buffer);
+		return true;
+	}
+
+	std::shared_ptr<CL_Memory_Tracker> _get_parent() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return parent;
+	}
 };
 
-class CL_Util {
+// Device, context and queue shared by several CL_Util, CL_Context and CL_Program
+// instances. Everything attached creates buffers in the same context, so a kernel of
+// one can use the buffers of another without copies. They also submit to the same
+// in-order queue, so their commands run in the order they were issued. A program is
+// built once per (source, options) and then reused by every attached instance.
+//     auto session = std::make_shared<CL_Session>();
+//     CL_Util a(session, "a.cl", "produce"), b(session, "b.cl", "consume");
+class CL_Session {
 public:
-	CL_Util() {
-		init();
+	CL_Session(std::vector<std::string> extensions = {}, std::vector<std::string> keywords = {}) {
+		if (use_native_backend()) {
+			native_device = std::make_shared<Native_Device>();
+			return;
+		}
+
+		CL_Hardware_Info hardware_info(extensions, keywords);
+		device_id = hardware_info.device_to_use;
+		_create_context_and_queue();
 	}
 
-	CL_Util(const char* filename, std::vector <std::string> extensions = {}) : required_device_extensions(extensions) {
-		init();
+	CL_Session(cl_device_id device_id, cl_context_properties* props = nullptr) : device_id(device_id), props(props) {
+		_create_context_and_queue();
+	}
 
-		create_and_build_program(filename);
+	~CL_Session() {
+		for (auto& entry : programs)
+			clReleaseProgram(entry.second.get().program);
+		if (queue)
+			clReleaseCommandQueue(queue);
+		if (context)
+			clReleaseContext(context);
 	}
 
-	CL_Util(const char* filename, const char* function_name, std::vector <std::string> extensions = {}) : required_device_extensions(extensions) {
-		init();
+	CL_Session(const CL_Session&) = delete;
+	CL_Session& operator=(const CL_Session&) = delete;
 
-		create_program_and_kernel(filename, function_name);
+	// CL_UTIL_BACKEND=native or =opencl forces a backend, otherwise OpenCL is used whenever
+	// a device exists
+	static bool use_native_backend() {
+		const char* backend = getenv("CL_UTIL_BACKEND");
+		if (backend && std::string(backend) == "native")
+			return true;
+		if (backend && std::string(backend) == "opencl")
+			return false;
+		return !CL_Hardware_Info::opencl_available();
 	}
 
-	CL_Util(const char* filename, const char* function_name, size_t global_size, size_t local_size, std::vector <std::string> extensions = {}) : required_device_extensions(extensions) {
-		init();
+	// A native session has no context; attached CL_Utils run on the native backend
+	bool is_native() { return context == nullptr; }
 
-		global_item_size = global_size;
-		local_item_size = local_size;
+	// Owns the memory of every attached native CL_Util, so shared buffers outlive their creator
+	std::shared_ptr<Native_Device> get_native_device() { return native_device; }
 
+	cl_device_id     get_device_id() { return device_id; }
+	cl_context       get_context()   { return context;   }
+	cl_command_queue get_queue()     { return queue;     }
 
-		create_program_and_kernel(filename, function_name);
+	// Built program for this source and options, shared by everything attached
+	cl_program get_program(const std::string& source, const std::string& options = "") {
+		cl_program program = nullptr;
+		cl_int err = build_program(source, options, program);
+		if (err) {
+			if (!program)
+				assert_cl_success(err, "Error creating program");
+			_assert_program_build_success(program, err, options);
+		}
+		return program;
+	}
+
+	// Like get_program, but returns the error instead of exiting so it can be reported
+	// later, e.g. by CL_Util::wait_for_program. Different programs build at the same time;
+	// callers asking for one that is already building wait for that build. Failed builds
+	// are not cached.
+	cl_int build_program(const std::string& source, const std::string& options, cl_program& program) {
+		program = nullptr;
+		if (is_native())
+			return CL_SUCCESS;
+
+		std::string key = options + "|" + source;
+		std::promise<Program_Build> promise;
+		std::shared_future<Program_Build> future;
+		bool building = false;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = programs.find(key);
+			if (it != programs.end()) {
+				future = it->second;
+			}
+			else {
+				future = promise.get_future().share();
+				programs[key] = future;
+				building = true;
+			}
+		}
+
+		if (building) {
+			Program_Build result = _build(source, options);
+			if (result.err) {
+				std::lock_guard<std::mutex> lock(mutex);
+				programs.erase(key);
+			}
+			promise.set_value(result);
+		}
+
+		program = future.get().program;
+		return future.get().err;
+	}
+
+	cl_program get_program_from_file(const char* filename, const std::string& options = "") {
+		if (is_native())
+			return nullptr;
+		return get_program(read_file(filename), options);
+	}
+
+	int get_num_programs() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return (int)programs.size();
+	}
+
+	// Named buffers for handing data from one attached instance to another
+	void share_buffer(std::string name, CL_Buffer buffer) {
+		std::lock_guard<std::mutex> lock(mutex);
+		buffers.erase(name);
+		buffers.emplace(name, buffer);
+	}
+
+	CL_Buffer get_shared_buffer(std::string name) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = buffers.find(name);
+		if (it == buffers.end()) {
+			std::cout << "Error! No buffer has been shared with the name: " << name << "\n";
+			exit(1);
+		}
+		return it->second;
+	}
+
+	// Counts the buffers of every attached CL_Util; a budget set here limits all of them
+	std::shared_ptr<CL_Memory_Tracker> get_memory_tracker() { return memory_tracker; }
+
+private:
+	cl_device_id device_id = nullptr;
+	cl_context_properties* props = nullptr;
+	cl_context context = nullptr;
+	cl_command_queue queue = nullptr;
+	std::shared_ptr<Native_Device> native_device;
+
+	struct Program_Build {
+		cl_program program;
+		cl_int err;
+	};
+
+	std::map<std::string, std::shared_future<Program_Build>> programs;
+	std::map<std::string, CL_Buffer> buffers;
+	std::mutex mutex;
+
+	std::shared_ptr<CL_Memory_Tracker> memory_tracker = std::make_shared<CL_Memory_Tracker>("CL_Session");
+
+	void _create_context_and_queue() {
+		cl_int err;
+
+		context = clCreateContext((const cl_context_properties*)props, 1, &device_id, nullptr, nullptr, &err);
+		assert_cl_success(err, "Error creating OpenCL context");
+
+		queue = clCreateCommandQueueWithProperties(context, device_id, 0, &err);
+		assert_cl_success(err, "Error creating OpenCL command queue");
+	}
+
+	Program_Build _build(const std::string& source, const std::string& options) {
+		Program_Build result = { nullptr, CL_SUCCESS };
+		const char* program_source = source.c_str();
+		size_t source_length = 0;
+
+		result.program = clCreateProgramWithSource(context, 1, &program_source, &source_length, &result.err);
+		if (result.err) {
+			result.program = nullptr;
+			return result;
+		}
+		result.err = clBuildProgram(result.program, 1, &device_id, options.c_str(), nullptr, nullptr);
+		return result;
+	}
+
+	void _assert_program_build_success(cl_program program, const cl_int err, const std::string& options) {
+		assert_program_build_success(program, device_id, err, options);
+	}
+};
+
+class CL_Program;
+
+class CL_Context {
+public:
+	std::vector<CL_Program> programs;
+
+	CL_Context(cl_device_id device_id, cl_context_properties* props): device_id(device_id), props(props) {
+		make();
+	}
+
+	// Uses the session's context and queue instead of making its own
+	CL_Context(std::shared_ptr<CL_Session> session): session(session), device_id(session->get_device_id()), props(nullptr) {
+		context = session->get_context();
+		queue = session->get_queue();
+	}
+
+	void update_props(cl_context_properties* _props, bool should_remake = true) {
+		props = _props;
+		if (should_remake)
+			make();
+	}
+
+	void change_device(cl_device_id id, bool should_remake = true) {
+		device_id = id;
+		if (should_remake)
+			make();
+	}
+
+	// Making a new context leaves the session
+	void make() {
+		session = nullptr;
+		create_context();
+		create_queue();
+	}
+
+	void create_context() {
+		cl_int err;
+
+		cl_context _context = clCreateContext((const cl_context_properties*)props, 1, &device_id, nullptr, nullptr, &err);
+		assert_cl_success(err, "Error creating OpenCL context");
+		context = _context;
+	}
+
+	void create_queue() {
+		cl_int err;
+
+		cl_command_queue _queue = clCreateCommandQueueWithProperties(context, device_id, 0, &err);
+		assert_cl_success(err, "Error creating OpenCL command queue");
+		queue = _queue;
+	}
+
+	void create_program(const char* function_name) {
+		//programs.push_back(CL_Program(function_name, *this));
+	}
+
+	cl_device_id get_device_id() {
+		return device_id;
+	}
+
+	cl_context_properties* get_properties() {
+		return props;
+	}
+
+	cl_context get_context() {
+		return context;
+	}
+
+	cl_command_queue get_command_queue() {
+		return queue;
+	}
+
+	std::shared_ptr<CL_Session> get_session() {
+		return session;
+	}
+
+private:
+	std::shared_ptr<CL_Session> session;
+	cl_device_id device_id;
+	cl_context_properties* props;
+	cl_context context;
+	cl_command_queue queue;
+
+
+};
+
+class CL_Program {
+public:
+	CL_Program(const char* filename, CL_Context context): context(context) {
+		cl_int err;
+
+		source = read_file(filename);
+
+		// The session builds each program once for everything attached to it
+		if (context.get_session()) {
+			program = context.get_session()->get_program(source);
+			return;
+		}
+
+		const char* program_source = source.c_str();
+		size_t source_length = 0;
+
+		cl_program _program = clCreateProgramWithSource(context.get_context(), 1, &program_source, &source_length, &err);
+		assert_cl_success(err, "Error creating program");
+
+		program = _program;
+
+		build_program();
+	}
+
+	void build_program(CL_Build_Options options = CL_Build_Options()) {
+		if (context.get_session()) {
+			program = context.get_session()->get_program(source, options.str());
+			return;
+		}
+
+		cl_device_id device_id = context.get_device_id();
+		cl_int err = clBuildProgram(program, 1, &device_id, options.c_str(), nullptr, nullptr);
+
+		if (err) {
+			std::cout << "Error building OpenCL program\n\tCode: " << err << "\n\n";
+
+			cl_int info_err;
+
+			char* log;
+			size_t log_length;
+			
+			info_err = clGetProgramBuildInfo(program, context.get_device_id(), CL_PROGRAM_BUILD_LOG, 0, nullptr, &log_length);
+
+			log = (char*)malloc(log_length);
+
+			info_err = clGetProgramBuildInfo(program, context.get_device_id(), CL_PROGRAM_BUILD_LOG, log_length, log, nullptr);
+
+			assert_cl_success(info_err, "Error getting OpenCL program build info");
+
+			std::cout << log << "\n";
+
+			exit(1);
+		}
+	}
+
+	cl_program get_program() {
+		return program;
+	}
+private:
+	cl_program program;
+	CL_Context context;
+	std::string source;
+};
+
+class CL_Kernel {
+public:
+	CL_Kernel(CL_Program program, const char* function_name): program(program), function_name(function_name) {
+		cl_int err;
+
+		cl_kernel _kernel = clCreateKernel(program.get_program(), function_name, &err);
+		assert_cl_success(err, "Error creating OpenCL kernel");
+
+		kernel = _kernel;
+	}
+
+	const char* get_function_name() {
+		return function_name;
+	}
+
+	cl_kernel get_kernel() {
+		return kernel;
+	}
+
+private:
+	CL_Program program;
+	const char* function_name;
+	cl_kernel kernel;
+};
+
+class CL_Util {
+public:
+	CL_Util() {
+		init();
+	}
+
+	CL_Util(const char* filename, std::vector <std::string> extensions = {}) : required_device_extensions(extensions) {
+		init();
+
+		create_and_build_program(filename);
+	}
+
+	CL_Util(const char* filename, const char* function_name, std::vector <std::string> extensions = {}) : required_device_extensions(extensions) {
+		init();
+
+		create_program_and_kernel(filename, function_name);
+	}
+
+	CL_Util(const char* filename, const char* function_name, size_t global_size, size_t local_size, std::vector <std::string> extensions = {}) : required_device_extensions(extensions) {
+		init();
+
+		global_item_size = global_size;
+		local_item_size = local_size;
+
+
+		create_program_and_kernel(filename, function_name);
+	}
+
+	// Binds the context and queue to one device or sub-device without running device discovery
+	CL_Util(cl_device_id device, const char* filename, const char* function_name) {
+		init(device);
+
+		create_program_and_kernel(filename, function_name);
+	}
+
+	// Shares the session's device, context, queue and programs with everything else attached to it
+	CL_Util(std::shared_ptr<CL_Session> session) {
+		attach_to_session(session);
+	}
+
+	CL_Util(std::shared_ptr<CL_Session> session, const char* filename, const char* function_name) {
+		attach_to_session(session);
+
+		create_program_and_kernel(filename, function_name);
 	}
 
 	void set_context_properties(cl_context_properties* cl_ctx_props) {
+		if (session) {
+			std::cout << "Error! Context properties of a shared session are set when the session is created" << "\n";
+			exit(1);
+		}
 		cl_context_props = cl_ctx_props;
+		if (native_device)
+			return;
 		_create_context();
 		_create_command_queue();
 		//init();
@@ -650,8 +1502,9 @@ public:
 		init();
 	}
 
-	void set_options() {
-
+	// Options used by every later build_program() and create_and_build_program()
+	void set_options(CL_Build_Options options) {
+		build_options = options;
 	}
 
 	// Getter methods
@@ -666,21 +1519,243 @@ public:
 	size_t get_local_item_size()  { return local_item_size;    }
 	int get_current_kernel_arg()  { return current_kernel_arg; }
 
+	// True when running on the native CPU backend instead of an OpenCL device
+	bool is_native() { return native_device != nullptr; }
+	std::shared_ptr<Native_Device> get_native_device() { return native_device; }
+
+	// Runs a C++ callable as the kernel on the native backend
+	void set_native_kernel(Native_Kernel kernel) {
+		if (!native_device) {
+			std::cout << "Error! Native kernels can only be set on the native backend" << "\n";
+			exit(1);
+		}
+		native_kernel = kernel;
+	}
+
 	void set_device(cl_device_id id) {
 		hardware_info.device_to_use = id;
 	}
 
+	// Moves the context and queue onto another device or sub-device, releasing the old ones.
+	// Programs and kernels have to be created again afterwards.
+	void bind_to_device(cl_device_id id) {
+		_release_owned_context();
+		init(id);
+	}
+
+	// Programs and kernels have to be created again afterwards, as with bind_to_device
+	void attach_to_session(std::shared_ptr<CL_Session> _session) {
+		session = _session;
+		tile_queue = nullptr;
+		memory_tracker->set_parent(session->get_memory_tracker());
+
+		if (session->is_native()) {
+			native_device = session->get_native_device();
+			native_kernel = Native_Kernel();
+			native_args = Native_Kernel_Args();
+			device_id = nullptr;
+			context = nullptr;
+			queue = nullptr;
+			return;
+		}
+		native_device = nullptr;
+		device_id = session->get_device_id();
+		hardware_info.device_to_use = device_id;
+		context = session->get_context();
+		queue = session->get_queue();
+	}
+
+	std::shared_ptr<CL_Session> get_session() { return session; }
+
 	void create_program(const char* filename) {
 		program = _create_program(filename);
 	}
 
 	void build_program() {
-		_build_program();
+		_build_program(program, build_options.str());
+	}
+
+	void build_program(CL_Build_Options options) {
+		_build_program(program, options.str());
 	}
 
 	void create_and_build_program(const char* filename) {
+		create_and_build_program(filename, build_options);
+	}
+
+	// Attached to a session, the program is built once and shared
+	void create_and_build_program(const char* filename, CL_Build_Options options) {
+		if (session) {
+			program = session->get_program_from_file(filename, options.str());
+			return;
+		}
 		program = _create_program(filename);
-		_build_program();
+		build_program(options);
+	}
+
+	// Program built from source with the given options. Each (source, options, device)
+	// variant is built once and reused by later calls.
+	cl_program get_program_variant(std::string source, CL_Build_Options options) {
+		if (native_device)
+			return nullptr;
+		if (session)
+			return session->get_program(source, options.str());
+
+		std::ostringstream key;
+		key << context << "|" << device_id << "|" << options.str() << "|" << source;
+		auto it = program_variants.find(key.str());
+		if (it != program_variants.end())
+			return it->second;
+
+		cl_program variant = _create_program_from_source(source);
+		_build_program(variant, options.str());
+		program_variants[key.str()] = variant;
+		return variant;
+	}
+
+	// Starts building a program in the background and returns immediately. Each build runs
+	// on a thread of a small pool, so several programs compile at once whether or not the
+	// driver builds asynchronously. Attached to a session, the build goes through the
+	// session's program cache. Use the program later by name.
+	void build_program_async(std::string name, const char* filename, CL_Build_Options options = CL_Build_Options()) {
+		std::shared_ptr<CL_Async_Build> build = std::make_shared<CL_Async_Build>();
+		build->name = name;
+		build->options = options.str();
+		build->device_id = device_id;
+		build->start = std::chrono::high_resolution_clock::now();
+		async_builds[name] = build;
+
+		// Nothing to compile on the native backend
+		if (native_device) {
+			build->finish(CL_SUCCESS);
+			return;
+		}
+
+		if (!build_pool)
+			build_pool = std::make_shared<CL_Build_Pool>();
+
+		std::string file = filename;
+		if (session) {
+			std::shared_ptr<CL_Session> build_session = session;
+			build_pool->submit([build, build_session, file]() {
+				cl_program program;
+				cl_int err = build_session->build_program(read_file(file.c_str()), build->options, program);
+				{
+					std::lock_guard<std::mutex> lock(build->mutex);
+					build->program = program;
+				}
+				build->finish(err);
+			});
+			return;
+		}
+
+		// The job keeps the context alive, since bind_to_device may release it while the
+		// build is still queued
+		cl_context build_context = context;
+		clRetainContext(build_context);
+		build_pool->submit([build, build_context, file]() {
+			cl_int err;
+
+			std::string s = read_file(file.c_str());
+			const char* program_source = s.c_str();
+			size_t source_length = 0;
+
+			cl_program program = clCreateProgramWithSource(build_context, 1, &program_source, &source_length, &err);
+			clReleaseContext(build_context);
+			if (err) {
+				build->finish(err);
+				return;
+			}
+			{
+				std::lock_guard<std::mutex> lock(build->mutex);
+				build->program = program;
+			}
+
+			// The callback holds its own reference, since it can run after this job ends. When
+			// clBuildProgram fails the callback has either already run or never will, so its
+			// reference is freed here unless it ran.
+			std::shared_ptr<CL_Async_Build>* callback_build = new std::shared_ptr<CL_Async_Build>(build);
+			err = clBuildProgram(program, 1, &build->device_id, build->options.c_str(), _on_program_built, callback_build);
+			if (err) {
+				bool callback_ran;
+				{
+					std::lock_guard<std::mutex> lock(build->mutex);
+					callback_ran = build->callback_ran;
+				}
+				if (!callback_ran)
+					delete callback_build;
+				build->finish(err);
+			}
+		});
+	}
+
+	// Starts every build at once, each on its own pool thread up to the number of hardware
+	// threads, e.g. at startup:
+	//     util.build_programs_async({ { "blur", "blur.cl" }, { "scan", "scan.cl" } });
+	void build_programs_async(std::vector<std::pair<std::string, std::string>> programs, CL_Build_Options options = CL_Build_Options()) {
+		for (auto& entry : programs)
+			build_program_async(entry.first, entry.second.c_str(), options);
+	}
+
+	bool is_program_ready(std::string name) {
+		return _get_async_build(name)->ready();
+	}
+
+	// Blocks only until this program is built; other builds keep running
+	cl_program wait_for_program(std::string name) {
+		std::shared_ptr<CL_Async_Build> build = _get_async_build(name);
+		build->wait();
+
+		if (build->status) {
+			if (!build->program)
+				assert_cl_success(build->status, "Error creating program");
+			_assert_program_build_success(build->program, build->status, build->options);
+		}
+		return build->program;
+	}
+
+	// Makes a kernel from an asynchronously built program the current one, waiting for
+	// that program if it is still building
+	void use_program_kernel(std::string name, const char* function_name) {
+		program = wait_for_program(name);
+		_use_cached_kernel(function_name);
+	}
+
+	// Milliseconds from build_program_async until the program was ready
+	double get_program_build_ms(std::string name) {
+		std::shared_ptr<CL_Async_Build> build = _get_async_build(name);
+		build->wait();
+		return build->build_ms;
+	}
+
+	// Build latency of every program that has finished so far
+	std::map<std::string, double> get_program_build_times() {
+		std::map<std::string, double> times;
+		for (auto& entry : async_builds) {
+			if (entry.second->ready())
+				times[entry.first] = entry.second->build_ms;
+		}
+		return times;
+	}
+
+	void print_program_build_times() {
+		for (auto& entry : async_builds) {
+			std::cout << "Program " << entry.first << ": ";
+			if (entry.second->ready())
+				std::cout << entry.second->build_ms << " ms" << (entry.second->status ? " (failed)" : "") << "\n";
+			else
+				std::cout << "still building" << "\n";
+		}
+	}
+
+	// Makes a specialized variant of a kernel the current one, e.g.
+	//     util.use_specialized_kernel("blur.cl", "blur", CL_Build_Options::constants<5>({ "RADIUS" }));
+	// Kernel objects are cached too, so switching between variants is cheap. On the native
+	// backend the options are ignored and the registered kernel of that name is used.
+	void use_specialized_kernel(const char* filename, const char* function_name, CL_Build_Options options) {
+		if (!native_device)
+			program = get_program_variant(read_file(filename), options);
+		_use_cached_kernel(function_name);
 	}
 
 	void create_kernel(const char* function_name) {
@@ -692,16 +1767,144 @@ public:
 		create_kernel(function_name);
 	}
 
-	cl_mem create_raw_buffer(size_t size, cl_mem_flags flags) {
-		cl_int err;
-		cl_mem buffer = clCreateBuffer(context, flags, size, nullptr, &err);
-		assert_cl_success(err, "Error creating OpenCL buffer");
-
+	// On the native backend the returned handle is the address of host memory. The tag
+	// groups the buffer in the memory report.
+	cl_mem create_raw_buffer(size_t size, cl_mem_flags flags, const std::string& tag = "untagged") {
+		cl_mem buffer = _allocate(size, flags, tag);
+		if (!buffer)
+			memory_tracker->fail_allocation("OpenCL buffer", size);
 		return buffer;
 	}
 
-	CL_Buffer create_buffer(size_t size, cl_mem_flags flags) {
-		cl_mem buffer = create_raw_buffer(size, flags);
+	CL_Buffer create_buffer(size_t size, cl_mem_flags flags, const std::string& tag = "untagged") {
+		cl_mem buffer = create_raw_buffer(size, flags, tag);
+
+		return CL_Buffer(buffer, size);
+	}
+
+	// Like create_buffer, but returns a null buffer instead of exiting when neither the
+	// budget nor the device has room after the trim callbacks ran. Many drivers allocate on
+	// first use, so a device that is really full may still only fail at the first enqueue.
+	CL_Buffer try_create_buffer(size_t size, cl_mem_flags flags, const std::string& tag = "untagged") {
+		cl_mem buffer = _allocate(size, flags, tag);
+		return buffer ? CL_Buffer(buffer, size) : CL_Buffer(nullptr, 0);
+	}
+
+	// Fallback for data that does not fit at once: the largest buffer of at most size bytes
+	// that fits, a multiple of min_size, for processing the data in chunks of buffer.size:
+	//     CL_Buffer chunk = util.create_chunk_buffer(bytes, 1 << 20, CL_MEM_READ_WRITE);
+	//     for (size_t offset = 0; offset < bytes; offset += chunk.size) { ... }
+	// A null buffer when not even min_size fits.
+	CL_Buffer create_chunk_buffer(size_t size, size_t min_size, cl_mem_flags flags, const std::string& tag = "untagged") {
+		min_size = std::max(std::min(min_size, size), (size_t)1);
+		memory_tracker->make_room(size);
+
+		size_t chunk_size = std::min(std::min(size, memory_tracker->get_available()), get_max_alloc_size());
+		chunk_size = chunk_size / min_size * min_size;
+		while (chunk_size >= min_size) {
+			cl_mem buffer = _allocate(chunk_size, flags, tag);
+			if (buffer)
+				return CL_Buffer(buffer, chunk_size);
+			chunk_size = chunk_size / 2 / min_size * min_size;
+		}
+		return CL_Buffer(nullptr, 0);
+	}
+
+	// Releases a buffer made by this CL_Util and stops counting it
+	void release_buffer(cl_mem buffer) {
+		if (!buffer)
+			return;
+		memory_tracker->remove(buffer);
+		if (native_device)
+			native_device->release((void*)buffer);
+		else
+			clReleaseMemObject(buffer);
+	}
+
+	void release_buffer(CL_Buffer buffer) {
+		release_buffer(buffer.buffer);
+	}
+
+	// Memory accounting. Buffers made through create_*buffer are counted until
+	// release_buffer; attached to a session they count towards the session too.
+
+	std::shared_ptr<CL_Memory_Tracker> get_memory_tracker() { return memory_tracker; }
+	size_t get_memory_used()      { return memory_tracker->get_used();      }
+	size_t get_memory_peak()      { return memory_tracker->get_peak();      }
+	size_t get_memory_available() { return memory_tracker->get_available(); }
+
+	void print_memory_report() {
+		memory_tracker->print_report();
+	}
+
+	// Memory allocated outside create_buffer, e.g. SVM or host memory wrapped in a buffer.
+	// reserve_memory makes room under the budget before allocating and exits like
+	// create_buffer when there is none. track_memory counts the allocation under its pointer
+	// or handle, and untrack_memory stops counting it before it is freed.
+	void reserve_memory(size_t size, const std::string& what) {
+		if (!memory_tracker->make_room(size))
+			memory_tracker->fail_allocation(what, size);
+	}
+
+	void track_memory(const void* key, size_t size, const std::string& tag) {
+		memory_tracker->add((cl_mem)key, size, tag);
+	}
+
+	void untrack_memory(const void* key) {
+		memory_tracker->remove((cl_mem)key);
+	}
+
+	// 0 turns the budget off
+	void set_memory_budget(size_t bytes) {
+		memory_tracker->set_budget(bytes);
+	}
+
+	// Budget as a fraction of CL_DEVICE_GLOBAL_MEM_SIZE, e.g. 0.8. The native backend has no
+	// device memory size, so this turns its budget off.
+	void set_memory_budget_fraction(double fraction) {
+		memory_tracker->set_budget((size_t)(fraction * (double)get_global_mem_size()));
+	}
+
+	// 0 on the native backend
+	size_t get_global_mem_size() {
+		if (native_device)
+			return 0;
+		cl_ulong size = 0;
+		clGetDeviceInfo(device_id, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(size), &size, nullptr);
+		return (size_t)size;
+	}
+
+	size_t get_max_alloc_size() {
+		if (native_device)
+			return std::numeric_limits<size_t>::max();
+		cl_ulong size = 0;
+		clGetDeviceInfo(device_id, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(size), &size, nullptr);
+		return size ? (size_t)size : std::numeric_limits<size_t>::max();
+	}
+
+	// trim(bytes needed) is called before an allocation would go over budget or after the
+	// device refused one. It should release cached buffers with release_buffer and return
+	// how many bytes it freed.
+	int add_memory_trim_callback(std::function<size_t(size_t)> trim) {
+		return memory_tracker->add_trim_callback(trim);
+	}
+
+	void remove_memory_trim_callback(int id) {
+		memory_tracker->remove_trim_callback(id);
+	}
+
+	// Host-visible buffer whose pages are first touched by this device's own queue.
+	// On CPU devices bound to a NUMA sub-device the fill runs on that node's cores,
+	// so first-touch placement puts the memory on the local node.
+	CL_Buffer create_numa_local_buffer(size_t size, cl_mem_flags flags) {
+		cl_mem buffer = create_raw_buffer(size, flags | CL_MEM_ALLOC_HOST_PTR);
+		if (native_device)
+			return CL_Buffer(buffer, size);
+
+		cl_uchar zero = 0;
+		cl_int err = clEnqueueFillBuffer(queue, buffer, &zero, sizeof(zero), 0, size, 0, nullptr, nullptr);
+		assert_cl_success(err, "Error filling OpenCL buffer");
+		clFinish(queue);
 
 		return CL_Buffer(buffer, size);
 	}
@@ -711,9 +1914,10 @@ public:
 		_write_to_buffer(buffer, size, data);
 	}
 
+	// Writes a single T; use the sized overloads for arrays
 	template <typename T>
 	void write_to_buffer(cl_mem buffer, T* data) {
-		write_to_buffer(buffer, sizeof(data), data);
+		write_to_buffer(buffer, sizeof(T), data);
 	}
 
 	template <typename T>
@@ -737,23 +1941,30 @@ public:
 
 	template <typename T>
 	CL_Buffer create_and_write_buffer(T* data, cl_mem_flags flags) {
-		CL_Buffer buffer = create_buffer(sizeof(data));
-		write_to_buffer(buffer.buffer, sizeof(data), data);
+		CL_Buffer buffer = create_buffer(sizeof(T), flags);
+		write_to_buffer(buffer.buffer, sizeof(T), data);
 
 		return buffer;
 	}
 
 	void read_from_buffer(void* data_ptr, CL_Buffer buffer) {
-		cl_int err = clEnqueueReadBuffer(queue, buffer.buffer, CL_TRUE, 0, buffer.size, data_ptr,
-			0, nullptr, nullptr);
+		read_from_buffer(data_ptr, buffer.size, buffer.buffer);
 	}
 
 	void read_from_buffer(void* data_ptr, size_t size, cl_mem buffer) {
+		if (native_device) {
+			memcpy(data_ptr, (void*)buffer, size);
+			return;
+		}
 		cl_int err = clEnqueueReadBuffer(queue, buffer, CL_TRUE, 0, size, data_ptr,
 			0, nullptr, nullptr);
 	}
 
 	void set_kernel_arg(int index, cl_mem buffer) {
+		if (native_device) {
+			native_args.set_buffer(index, (void*)buffer);
+			return;
+		}
 		cl_int err = clSetKernelArg(kernel, (cl_uint)index, sizeof(cl_mem), &buffer);
 		assert_cl_success(err, "Error setting OpenCL kernel arg");
 	}
@@ -771,6 +1982,51 @@ public:
 		set_kernel_arg(buffer.buffer);
 	}
 
+	// Uploads any host changes and assumes the kernel writes the whole vector, so the
+	// next host access downloads it. Bind right before the launch; for inputs the kernel
+	// only reads, pass vector.device_read() instead.
+	template <typename T>
+	void set_kernel_arg(int index, CL_Vector<T>& vector) {
+		set_kernel_arg(index, vector.device_write());
+	}
+
+	template <typename T>
+	void set_kernel_arg(CL_Vector<T>& vector) {
+		set_kernel_arg(vector.device_write());
+	}
+
+	// Binds a shared virtual memory pointer (from clSVMAlloc or CL_SVM). On the native
+	// backend any host pointer works.
+	void set_kernel_arg_svm(int index, const void* ptr) {
+		if (native_device) {
+			native_args.set_buffer(index, (void*)ptr);
+			return;
+		}
+		cl_int err = clSetKernelArgSVMPointer(kernel, (cl_uint)index, ptr);
+		assert_cl_success(err, "Error setting OpenCL kernel SVM arg");
+	}
+
+	void set_kernel_arg_svm(const void* ptr) {
+		set_kernel_arg_svm(current_kernel_arg, ptr);
+		current_kernel_arg++;
+	}
+
+	template <typename T>
+	void set_kernel_arg_value(int index, T value) {
+		if (native_device) {
+			native_args.set_value(index, &value, sizeof(T));
+			return;
+		}
+		cl_int err = clSetKernelArg(kernel, (cl_uint)index, sizeof(T), &value);
+		assert_cl_success(err, "Error setting OpenCL kernel arg");
+	}
+
+	template <typename T>
+	void set_kernel_arg_value(T value) {
+		set_kernel_arg_value(current_kernel_arg, value);
+		current_kernel_arg++;
+	}
+
 	void set_global_item_size(size_t global_size) {
 		global_item_size = global_size;
 	}
@@ -799,23 +2055,188 @@ public:
 			std::cout << "Local item size not initialized!" << "\n";
 			exit(1);
 		}
-		if (global_item_size % local_item_size != 0) {
-			std::cout << "Global item size must be divisible by local item size!" << "\n\n";
-			exit(1);
+		if (global_item_size % local_item_size != 0) {
+			std::cout << "Global item size must be divisible by local item size!" << "\n\n";
+			exit(1);
+		}
+		if (native_device) {
+			native_device->run(native_kernel, native_args, 1, &global_item_size, &local_item_size, nullptr);
+			return;
+		}
+		cl_int err = clEnqueueNDRangeKernel(queue, kernel, 1, 0, &global_item_size, &local_item_size,
+			0, nullptr, nullptr);
+		assert_cl_success(err, "Error enqueuing OpenCL kernel");
+	}
+
+	// Launches a 2D or 3D NDRange. An empty offset starts at the origin and an empty
+	// local size lets the implementation choose.
+	void run_kernel_nd(std::vector<size_t> global_size, std::vector<size_t> local_size, std::vector<size_t> offset = {}) {
+		_run_kernel_nd(queue, global_size, local_size, offset);
+	}
+
+	void run_kernel_2d(size_t global_x, size_t global_y, size_t local_x, size_t local_y, size_t offset_x = 0, size_t offset_y = 0) {
+		run_kernel_nd({ global_x, global_y }, { local_x, local_y }, { offset_x, offset_y });
+	}
+
+	void run_kernel_3d(size_t global_x, size_t global_y, size_t global_z, size_t local_x, size_t local_y, size_t local_z,
+		size_t offset_x = 0, size_t offset_y = 0, size_t offset_z = 0) {
+		run_kernel_nd({ global_x, global_y, global_z }, { local_x, local_y, local_z }, { offset_x, offset_y, offset_z });
+	}
+
+	// Covers a width x height domain with tile-sized launches that have no dependencies on
+	// each other, so an out-of-order queue can run them concurrently. Edge tiles are padded
+	// up to the local size and the real width and height are passed as two cl_uint args
+	// after the ones already set. As with the tuned launches the argument counter is not
+	// advanced, so the launch can be repeated without setting the arguments again.
+	// The tiles start after everything already enqueued, and later commands wait for them.
+	void run_kernel_tiled_2d(size_t width, size_t height, size_t tile_width, size_t tile_height, size_t local_x, size_t local_y) {
+		if (tile_width % local_x != 0 || tile_height % local_y != 0) {
+			std::cout << "Tile size must be divisible by local item size!" << "\n\n";
+			exit(1);
+		}
+		set_kernel_arg_value(current_kernel_arg, (cl_uint)width);
+		set_kernel_arg_value(current_kernel_arg + 1, (cl_uint)height);
+
+		cl_command_queue tile_queue = _get_tile_queue();
+		bool separate_queue = tile_queue && tile_queue != queue;
+
+		// A marker on the in-order queue ends with the work before the tiles
+		std::vector<cl_event> wait_list;
+		if (separate_queue) {
+			cl_event ready;
+			cl_int err = clEnqueueMarkerWithWaitList(queue, 0, nullptr, &ready);
+			assert_cl_success(err, "Error enqueuing OpenCL marker");
+			clFlush(queue);
+			wait_list.push_back(ready);
+		}
+
+		std::vector<cl_event> tiles;
+		for (size_t y = 0; y < height; y += tile_height) {
+			for (size_t x = 0; x < width; x += tile_width) {
+				size_t tile_x = _round_up(std::min(tile_width, width - x), local_x);
+				size_t tile_y = _round_up(std::min(tile_height, height - y), local_y);
+				cl_event tile = nullptr;
+				_run_kernel_nd(tile_queue, { tile_x, tile_y }, { local_x, local_y }, { x, y }, wait_list, separate_queue ? &tile : nullptr);
+				if (tile)
+					tiles.push_back(tile);
+			}
+		}
+
+		if (separate_queue) {
+			clFlush(tile_queue);
+			cl_int err = clEnqueueBarrierWithWaitList(queue, (cl_uint)tiles.size(), tiles.empty() ? nullptr : tiles.data(), nullptr);
+			assert_cl_success(err, "Error enqueuing OpenCL barrier");
+			for (cl_event event : wait_list)
+				clReleaseEvent(event);
+			for (cl_event event : tiles)
+				clReleaseEvent(event);
+		}
+	}
+
+	// Picks roughly square tiles so there are about as many tiles as compute units
+	void run_kernel_tiled_2d(size_t width, size_t height, size_t local_x, size_t local_y) {
+		cl_uint compute_units = 1;
+		if (native_device)
+			compute_units = (cl_uint)native_device->get_pool().get_num_threads();
+		else
+			clGetDeviceInfo(device_id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &compute_units, nullptr);
+
+		size_t tiles_x = 1, tiles_y = 1;
+		while (tiles_x * tiles_y < compute_units) {
+			if (width / tiles_x >= height / tiles_y)
+				tiles_x++;
+			else
+				tiles_y++;
+		}
+		size_t tile_width = _round_up((width + tiles_x - 1) / tiles_x, local_x);
+		size_t tile_height = _round_up((height + tiles_y - 1) / tiles_y, local_y);
+		run_kernel_tiled_2d(width, height, tile_width, tile_height, local_x, local_y);
+	}
+
+	// Runs the kernel over any global size using the fastest local size found for this
+	// (kernel, device, global size bucket). The range is padded up to a multiple of the
+	// local size and the real size is passed as a cl_uint in the argument after the ones
+	// already set (one per dimension), so the kernel can skip the padded work items:
+	//     if (get_global_id(0) >= n) return;
+	// The argument counter is not advanced, so repeated launches reuse the same arguments.
+	// The first run of a new bucket benchmarks every candidate, so the kernel runs several
+	// times and must be safe to repeat.
+	void run_kernel_tuned(size_t global_size) {
+		run_kernel_tuned(global_size, current_kernel_arg);
+	}
+
+	void run_kernel_tuned(size_t global_size, int size_arg_index) {
+		run_kernel_tuned_nd({ global_size }, size_arg_index);
+	}
+
+	void run_kernel_tuned_2d(size_t global_x, size_t global_y) {
+		run_kernel_tuned_nd({ global_x, global_y }, current_kernel_arg);
+	}
+
+	void run_kernel_tuned_3d(size_t global_x, size_t global_y, size_t global_z) {
+		run_kernel_tuned_nd({ global_x, global_y, global_z }, current_kernel_arg);
+	}
+
+	void run_kernel_tuned_nd(std::vector<size_t> global_size, int size_arg_index) {
+		for (int i = 0; i < (int)global_size.size(); i++) {
+			if (global_size[i] <= 0) {
+				std::cout << "Global item size not initialized!" << "\n";
+				exit(1);
+			}
+			set_kernel_arg_value(size_arg_index + i, (cl_uint)global_size[i]);
+		}
+
+		// Local size only sets task granularity on the native backend, so there is nothing to tune
+		if (native_device) {
+			std::vector<size_t> local_size = Native_Device::default_local_size((int)global_size.size());
+			run_kernel_nd(_round_up(global_size, local_size), local_size);
+			return;
 		}
-		cl_int err = clEnqueueNDRangeKernel(queue, kernel, 1, 0, &global_item_size, &local_item_size,
-			0, nullptr, nullptr);
-		assert_cl_success(err, "Error enqueuing OpenCL kernel");
+
+		std::string key = _autotune_key(global_size);
+		_load_autotune_cache();
+		auto it = autotune_cache.find(key);
+		if (it == autotune_cache.end() || it->second.size() != global_size.size()) {
+			autotune_cache[key] = _benchmark_local_sizes(global_size);
+			_save_autotune_cache();
+		}
+
+		std::vector<size_t> local_size = autotune_cache[key];
+		run_kernel_nd(_round_up(global_size, local_size), local_size);
+	}
+
+	// Where tuned local sizes are persisted between runs
+	void set_autotune_cache_file(std::string filename) {
+		autotune_cache_file = filename;
+		autotune_cache_loaded = false;
+		autotune_cache.clear();
+	}
+
+	// Number of timed launches per candidate local size
+	void set_autotune_repetitions(int repetitions) {
+		autotune_repetitions = repetitions;
+	}
+
+	// Upper bound on the local sizes tried per kernel and global size
+	void set_autotune_max_candidates(int max_candidates) {
+		autotune_max_candidates = max_candidates;
 	}
 
 	void finish_queue() {
+		if (native_device) {
+			// Native launches complete before run_kernel returns
+			current_kernel_arg = 0;
+			return;
+		}
 		clFinish(queue);
+		if (tile_queue)
+			clFinish(tile_queue);
 		current_kernel_arg = 0;
 	}
 
 private:
 	CL_Hardware_Info hardware_info;
-	cl_context_properties* cl_context_props;
+	cl_context_properties* cl_context_props = nullptr;
 
 	std::vector<std::string> required_device_extensions;
 	std::vector<std::string> device_keywords;
@@ -830,7 +2251,44 @@ private:
 
 	int current_kernel_arg = 0;
 
+	CL_Build_Options build_options;
+	std::map<std::string, cl_program> program_variants;
+	std::map<std::pair<cl_program, std::string>, cl_kernel> kernel_variants;
+	std::map<std::string, std::shared_ptr<CL_Async_Build>> async_builds;
+	std::shared_ptr<CL_Build_Pool> build_pool;
+
+	std::string autotune_cache_file = "cl_autotune_cache.txt";
+	std::map<std::string, std::vector<size_t>> autotune_cache;
+	bool autotune_cache_loaded = false;
+	int autotune_repetitions = 5;
+	int autotune_max_candidates = 24;
+
+	cl_command_queue tile_queue = nullptr;
+
+	// Shared with the session when attached to one; the kernel and its arguments are per util
+	std::shared_ptr<Native_Device> native_device;
+	Native_Kernel native_kernel;
+	Native_Kernel_Args native_args;
+	std::shared_ptr<CL_Session> session;
+	std::shared_ptr<CL_Memory_Tracker> memory_tracker = std::make_shared<CL_Memory_Tracker>("CL_Util");
+
 	void init() {
+		session = nullptr;
+		tile_queue = nullptr;
+		memory_tracker->set_parent(nullptr);
+
+		if (_use_native_backend()) {
+			native_device = std::make_shared<Native_Device>();
+			native_kernel = Native_Kernel();
+			native_args = Native_Kernel_Args();
+			device_id = nullptr;
+			context = nullptr;
+			queue = nullptr;
+			std::cout << "Chosen Device: Native CPU backend (" << native_device->get_pool().get_num_threads() << " threads)" << std::endl;
+			return;
+		}
+		native_device = nullptr;
+
 		hardware_info = CL_Hardware_Info(required_device_extensions, device_keywords);
 
 		device_id = _get_device_id();
@@ -845,27 +2303,49 @@ private:
 		}
 	}
 
-	void _assert_program_build_success(const cl_int err) {
-		if (err) {
-			std::cout << "Error building OpenCL program\n\tCode: " << err << "\n\n";
+	void init(cl_device_id id) {
+		session = nullptr;
+		tile_queue = nullptr;
+		memory_tracker->set_parent(nullptr);
+		native_device = nullptr;
+		hardware_info.device_to_use = id;
 
-			cl_int info_err;
+		device_id = id;
 
-			char* log;
-			size_t log_length;
+		context = _create_context();
 
-			info_err = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, 0, nullptr, &log_length);
+		queue = _create_command_queue();
+	}
 
-			log = (char*)malloc(log_length);
+	bool _use_native_backend() {
+		return CL_Session::use_native_backend();
+	}
 
-			info_err = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, log_length, log, nullptr);
+	// The context, queues and cached variants this util created itself; a session or the
+	// native backend owns nothing here
+	void _release_owned_context() {
+		if (session || native_device || !context)
+			return;
 
-			assert_cl_success(info_err, "Error getting OpenCL program build info");
+		for (auto& entry : kernel_variants)
+			clReleaseKernel(entry.second);
+		kernel_variants.clear();
+		for (auto& entry : program_variants)
+			clReleaseProgram(entry.second);
+		program_variants.clear();
 
-			std::cout << log << "\n";
-			
-			exit(1);
-		}
+		if (tile_queue)
+			clReleaseCommandQueue(tile_queue);
+		tile_queue = nullptr;
+		if (queue)
+			clReleaseCommandQueue(queue);
+		queue = nullptr;
+		clReleaseContext(context);
+		context = nullptr;
+	}
+
+	void _assert_program_build_success(cl_program program, const cl_int err, const std::string& options) {
+		assert_program_build_success(program, device_id, err, options);
 	}
 
 	cl_device_id _get_device_id() {
@@ -890,10 +2370,43 @@ private:
 		return queue;
 	}
 
+	// Null when neither the budget nor the device has room, even after trimming
+	cl_mem _allocate(size_t size, cl_mem_flags flags, const std::string& tag) {
+		if (!native_device)
+			return memory_tracker->create_buffer(context, size, flags, tag);
+
+		if (!memory_tracker->make_room(size))
+			return nullptr;
+
+		cl_mem buffer = nullptr;
+		try {
+			buffer = (cl_mem)native_device->allocate(size);
+		}
+		catch (const std::bad_alloc&) {
+			if (!memory_tracker->make_room(size, true))
+				return nullptr;
+			try {
+				buffer = (cl_mem)native_device->allocate(size);
+			}
+			catch (const std::bad_alloc&) {
+				return nullptr;
+			}
+		}
+
+		memory_tracker->add(buffer, size, tag);
+		return buffer;
+	}
+
 	cl_program _create_program(const char* filename) {
+		if (native_device)
+			return nullptr;
+
+		return _create_program_from_source(read_file(filename));
+	}
+
+	cl_program _create_program_from_source(const std::string& s) {
 		cl_int err;
 
-		std::string s = read_file(filename);
 		const char* program_source = s.c_str();
 		size_t source_length = 0;
 
@@ -903,12 +2416,58 @@ private:
 		return program;
 	}
 
-	void _build_program() {
-		cl_int err = clBuildProgram(program, 1, &device_id, "", nullptr, nullptr);
-		_assert_program_build_success(err);
+	void _build_program(cl_program target, const std::string& options) {
+		if (native_device)
+			return;
+		cl_int err = clBuildProgram(target, 1, &device_id, options.c_str(), nullptr, nullptr);
+		_assert_program_build_success(target, err, options);
+	}
+
+	static void CL_CALLBACK _on_program_built(cl_program program, void* user_data) {
+		std::shared_ptr<CL_Async_Build>* build = (std::shared_ptr<CL_Async_Build>*)user_data;
+
+		cl_build_status status = CL_BUILD_ERROR;
+		clGetProgramBuildInfo(program, (*build)->device_id, CL_PROGRAM_BUILD_STATUS, sizeof(status), &status, nullptr);
+		{
+			std::lock_guard<std::mutex> lock((*build)->mutex);
+			(*build)->callback_ran = true;
+		}
+		(*build)->finish(status == CL_BUILD_SUCCESS ? CL_SUCCESS : CL_BUILD_PROGRAM_FAILURE);
+
+		delete build;
+	}
+
+	std::shared_ptr<CL_Async_Build> _get_async_build(const std::string& name) {
+		auto it = async_builds.find(name);
+		if (it == async_builds.end()) {
+			std::cout << "Error! No program is being built with the name: " << name << "\n";
+			exit(1);
+		}
+		return it->second;
+	}
+
+	// Current kernel for function_name in the current program, created once per program
+	void _use_cached_kernel(const char* function_name) {
+		current_kernel_arg = 0;
+		if (native_device) {
+			kernel = _create_kernel(function_name);
+			return;
+		}
+
+		std::pair<cl_program, std::string> key(program, function_name);
+		auto it = kernel_variants.find(key);
+		if (it == kernel_variants.end())
+			it = kernel_variants.emplace(key, _create_kernel(function_name)).first;
+		kernel = it->second;
 	}
 
+	// The native backend takes the kernel registered under the same function name
 	cl_kernel _create_kernel(const char* function_name) {
+		if (native_device) {
+			native_kernel = Native_Kernel_Registry::find(function_name);
+			return nullptr;
+		}
+
 		cl_int err;
 
 		cl_kernel kernel = clCreateKernel(program, function_name, &err);
@@ -919,7 +2478,591 @@ private:
 
 	template <typename T>
 	void _write_to_buffer(cl_mem buffer, size_t size, T* data) {
+		if (native_device) {
+			memcpy((void*)buffer, data, size);
+			return;
+		}
 		cl_int err = clEnqueueWriteBuffer(queue, buffer, CL_TRUE, 0, size, data, 0, nullptr, nullptr);
 		assert_cl_success(err, "Error writing to buffer");
 	}
-};
\ No newline at end of file
+
+	static size_t _round_up(size_t value, size_t multiple) {
+		return ((value + multiple - 1) / multiple) * multiple;
+	}
+
+	static std::vector<size_t> _round_up(std::vector<size_t> values, std::vector<size_t> multiples) {
+		for (int i = 0; i < (int)values.size(); i++)
+			values[i] = _round_up(values[i], multiples[i]);
+		return values;
+	}
+
+	cl_int _enqueue_nd(cl_command_queue target_queue, const std::vector<size_t>& global_size, const std::vector<size_t>& local_size, const std::vector<size_t>& offset,
+		const std::vector<cl_event>& wait_list = {}, cl_event* event = nullptr) {
+		return clEnqueueNDRangeKernel(target_queue, kernel, (cl_uint)global_size.size(), offset.empty() ? nullptr : offset.data(),
+			global_size.data(), local_size.empty() ? nullptr : local_size.data(), (cl_uint)wait_list.size(), wait_list.empty() ? nullptr : wait_list.data(), event);
+	}
+
+	void _run_kernel_nd(cl_command_queue target_queue, const std::vector<size_t>& global_size, const std::vector<size_t>& local_size, const std::vector<size_t>& offset,
+		const std::vector<cl_event>& wait_list = {}, cl_event* event = nullptr) {
+		if (global_size.size() < 1 || global_size.size() > 3) {
+			std::cout << "Work dimension must be 1, 2 or 3!" << "\n";
+			exit(1);
+		}
+		if (!local_size.empty() && local_size.size() != global_size.size()) {
+			std::cout << "Local item size must have one entry per dimension!" << "\n";
+			exit(1);
+		}
+		if (!offset.empty() && offset.size() != global_size.size()) {
+			std::cout << "Offset must have one entry per dimension!" << "\n";
+			exit(1);
+		}
+		for (int i = 0; i < (int)global_size.size(); i++) {
+			if (global_size[i] <= 0) {
+				std::cout << "Global item size not initialized!" << "\n";
+				exit(1);
+			}
+			if (local_size.empty())
+				continue;
+			if (local_size[i] <= 0) {
+				std::cout << "Local item size not initialized!" << "\n";
+				exit(1);
+			}
+			if (global_size[i] % local_size[i] != 0) {
+				std::cout << "Global item size must be divisible by local item size in dimension " << i << "!" << "\n\n";
+				exit(1);
+			}
+		}
+
+		if (native_device) {
+			native_device->run(native_kernel, native_args, (unsigned int)global_size.size(), global_size.data(), local_size.empty() ? nullptr : local_size.data(),
+				offset.empty() ? nullptr : offset.data());
+			return;
+		}
+
+		cl_int err = _enqueue_nd(target_queue, global_size, local_size, offset, wait_list, event);
+		assert_cl_success(err, "Error enqueuing OpenCL kernel");
+	}
+
+	// Out-of-order queue for independent tiles, or the normal queue if the device has none
+	cl_command_queue _get_tile_queue() {
+		if (tile_queue)
+			return tile_queue;
+
+		if (native_device)
+			return nullptr;
+
+		cl_command_queue_properties supported = 0;
+		clGetDeviceInfo(device_id, CL_DEVICE_QUEUE_ON_HOST_PROPERTIES, sizeof(supported), &supported, nullptr);
+		if (!(supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE))
+			return queue;
+
+		cl_int err;
+		cl_queue_properties props[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, 0 };
+		tile_queue = clCreateCommandQueueWithProperties(context, device_id, props, &err);
+		assert_cl_success(err, "Error creating OpenCL command queue");
+		return tile_queue;
+	}
+
+	std::string _kernel_name() {
+		size_t name_size;
+		cl_int err = clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, 0, nullptr, &name_size);
+		assert_cl_success(err, "Error getting OpenCL kernel info");
+
+		std::string name(name_size, '\0');
+		err = clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, name_size, &name[0], nullptr);
+		assert_cl_success(err, "Error getting OpenCL kernel info");
+		name.resize(strlen(name.c_str()));
+		return name;
+	}
+
+	std::string _device_name() {
+		size_t name_size;
+		cl_int err = clGetDeviceInfo(device_id, CL_DEVICE_NAME, 0, nullptr, &name_size);
+		assert_cl_success(err, "Error getting OpenCL device info");
+
+		std::string name(name_size, '\0');
+		err = clGetDeviceInfo(device_id, CL_DEVICE_NAME, name_size, &name[0], nullptr);
+		assert_cl_success(err, "Error getting OpenCL device info");
+		name.resize(strlen(name.c_str()));
+		return name;
+	}
+
+	// Source and build options of the kernel's program, hashed so that variants of a kernel
+	// with the same name are tuned separately. FNV-1a, so keys stay stable between runs.
+	std::string _program_hash() {
+		cl_program kernel_program;
+		cl_int err = clGetKernelInfo(kernel, CL_KERNEL_PROGRAM, sizeof(cl_program), &kernel_program, nullptr);
+		assert_cl_success(err, "Error getting OpenCL kernel info");
+
+		std::string text;
+		size_t size = 0;
+		if (clGetProgramInfo(kernel_program, CL_PROGRAM_SOURCE, 0, nullptr, &size) == CL_SUCCESS && size > 0) {
+			std::string source(size, '\0');
+			if (clGetProgramInfo(kernel_program, CL_PROGRAM_SOURCE, size, &source[0], nullptr) == CL_SUCCESS)
+				text += source;
+		}
+		text += '\0';
+		size = 0;
+		if (clGetProgramBuildInfo(kernel_program, device_id, CL_PROGRAM_BUILD_OPTIONS, 0, nullptr, &size) == CL_SUCCESS && size > 0) {
+			std::string options(size, '\0');
+			if (clGetProgramBuildInfo(kernel_program, device_id, CL_PROGRAM_BUILD_OPTIONS, size, &options[0], nullptr) == CL_SUCCESS)
+				text += options;
+		}
+
+		unsigned long long hash = 14695981039346656037ull;
+		for (char c : text) {
+			hash ^= (unsigned char)c;
+			hash *= 1099511628211ull;
+		}
+		std::ostringstream stream;
+		stream << std::hex << std::setw(16) << std::setfill('0') << hash;
+		return stream.str();
+	}
+
+	// Global sizes are grouped by the next power of two so nearby sizes share a result
+	std::string _autotune_key(const std::vector<size_t>& global_size) {
+		std::string key = _device_name() + "|" + _kernel_name() + "|" + _program_hash() + "|";
+		for (int i = 0; i < (int)global_size.size(); i++) {
+			size_t bucket = 1;
+			while (bucket < global_size[i])
+				bucket <<= 1;
+			key += (i > 0 ? "x" : "") + std::to_string(bucket);
+		}
+		return key;
+	}
+
+	// Shapes whose product is a multiple of the preferred work-group multiple and fits
+	// CL_KERNEL_WORK_GROUP_SIZE: powers of two per dimension, plus 1, 2, 3, 4, 6, 8, 12, ...
+	// times the multiple in x with powers of two in the other dimensions, so multiples such
+	// as 48 or 96 still get a full set. At most autotune_max_candidates are kept, spread evenly
+	// over the range of work-group sizes.
+	std::vector<std::vector<size_t>> _local_size_candidates(int work_dim) {
+		size_t max_size, multiple;
+		cl_int err = clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &max_size, nullptr);
+		assert_cl_success(err, "Error getting OpenCL kernel work group info");
+		err = clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &multiple, nullptr);
+		assert_cl_success(err, "Error getting OpenCL kernel work group info");
+
+		size_t max_item_sizes[3] = { max_size, max_size, max_size };
+		clGetDeviceInfo(device_id, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(max_item_sizes), max_item_sizes, nullptr);
+
+		if (multiple == 0 || multiple > max_size)
+			multiple = 1;
+
+		std::vector<std::vector<size_t>> sizes_per_dim(work_dim);
+		for (int dim = 0; dim < work_dim; dim++) {
+			for (size_t size = 1; size <= max_item_sizes[dim] && size <= max_size; size *= 2)
+				sizes_per_dim[dim].push_back(size);
+		}
+		size_t max_x = std::min(max_size, max_item_sizes[0]);
+		for (size_t size = multiple; size <= max_x; size *= 2) {
+			sizes_per_dim[0].push_back(size);
+			if (size >= 2 * multiple && size / 2 * 3 <= max_x)
+				sizes_per_dim[0].push_back(size * 3 / 2);
+		}
+		if (max_x >= multiple)
+			sizes_per_dim[0].push_back(max_x / multiple * multiple);
+		std::sort(sizes_per_dim[0].begin(), sizes_per_dim[0].end());
+		sizes_per_dim[0].erase(std::unique(sizes_per_dim[0].begin(), sizes_per_dim[0].end()), sizes_per_dim[0].end());
+
+		std::vector<std::vector<size_t>> candidates{ {} };
+		for (int dim = 0; dim < work_dim; dim++) {
+			std::vector<std::vector<size_t>> extended;
+			for (auto& candidate : candidates) {
+				size_t product = 1;
+				for (size_t size : candidate)
+					product *= size;
+				for (size_t size : sizes_per_dim[dim]) {
+					if (product * size > max_size)
+						break;
+					extended.push_back(candidate);
+					extended.back().push_back(size);
+				}
+			}
+			candidates = extended;
+		}
+
+		std::vector<std::pair<size_t, std::vector<size_t>>> valid;
+		for (auto& candidate : candidates) {
+			size_t product = 1;
+			for (size_t size : candidate)
+				product *= size;
+			if (product % multiple == 0)
+				valid.push_back(std::make_pair(product, candidate));
+		}
+		std::sort(valid.begin(), valid.end());
+
+		std::vector<std::vector<size_t>> kept;
+		size_t limit = (size_t)std::max(autotune_max_candidates, 1);
+		for (size_t i = 0; i < std::min(limit, valid.size()); i++) {
+			size_t index = valid.size() <= limit ? i : (limit == 1 ? valid.size() - 1 : i * (valid.size() - 1) / (limit - 1));
+			kept.push_back(valid[index].second);
+		}
+		return kept;
+	}
+
+	std::vector<size_t> _benchmark_local_sizes(const std::vector<size_t>& global_size) {
+		std::vector<size_t> best_size;
+		double best_time = 0;
+
+		for (auto& local_size : _local_size_candidates((int)global_size.size())) {
+			std::vector<size_t> padded_size = _round_up(global_size, local_size);
+
+			// Warm-up launch so compilation and first-touch costs are not timed
+			cl_int err = _enqueue_nd(queue, padded_size, local_size, {});
+			if (err)
+				continue;
+			clFinish(queue);
+
+			auto start = std::chrono::high_resolution_clock::now();
+			for (int i = 0; i < autotune_repetitions; i++) {
+				_enqueue_nd(queue, padded_size, local_size, {});
+			}
+			clFinish(queue);
+			double time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+			if (best_size.empty() || time < best_time) {
+				best_size = local_size;
+				best_time = time;
+			}
+		}
+
+		if (best_size.empty()) {
+			std::cout << "Error! No local item size could run the kernel" << "\n";
+			exit(1);
+		}
+		return best_size;
+	}
+
+	void _load_autotune_cache() {
+		if (autotune_cache_loaded)
+			return;
+		autotune_cache_loaded = true;
+
+		std::ifstream f(autotune_cache_file);
+		std::string line;
+		while (std::getline(f, line)) {
+			size_t tab_pos = line.rfind('\t');
+			if (tab_pos == std::string::npos)
+				continue;
+			std::istringstream sizes(line.substr(tab_pos + 1));
+			std::vector<size_t> local_size;
+			size_t size;
+			bool valid = true;
+			while (valid && sizes >> size) {
+				valid = size > 0;
+				local_size.push_back(size);
+			}
+			// Corrupt or truncated lines are skipped and tuned again
+			if (!valid || !sizes.eof() || local_size.empty() || local_size.size() > 3)
+				continue;
+			autotune_cache[line.substr(0, tab_pos)] = local_size;
+		}
+	}
+
+	void _save_autotune_cache() {
+		std::ofstream f(autotune_cache_file, std::ios_base::trunc);
+		for (auto& entry : autotune_cache) {
+			f << entry.first << "\t";
+			for (int i = 0; i < (int)entry.second.size(); i++)
+				f << (i > 0 ? " " : "") << entry.second[i];
+			f << "\n";
+		}
+	}
+};
+
+struct CL_Multi_Buffer {
+	std::vector<cl_mem> buffers;
+	size_t size;
+
+	CL_Multi_Buffer(std::vector<cl_mem> buffers, size_t size) : buffers(buffers), size(size) {
+
+	};
+};
+
+class CL_Multi_Util {
+public:
+	CL_Multi_Util(const char* filename, const char* function_name, std::vector<std::string> extensions = {}, std::vector<std::string> keywords = {}) {
+		CL_Hardware_Info hardware_info(extensions, keywords);
+		init(hardware_info.devices_to_use, filename, function_name);
+	}
+
+	// Use an explicit set of devices, e.g. several sub-devices of one CPU
+	CL_Multi_Util(std::vector<cl_device_id> device_ids, const char* filename, const char* function_name) {
+		init(device_ids, filename, function_name);
+	}
+
+	int get_num_devices() { return (int)slots.size(); }
+	cl_device_id get_device_id(int i) { return slots[i].device_id; }
+	cl_context get_context(int i) { return slots[i].context; }
+	cl_command_queue get_queue(int i) { return slots[i].queue; }
+	cl_kernel get_kernel(int i) { return slots[i].kernel; }
+
+	// Fraction of the NDRange each device currently receives
+	std::vector<double> get_device_shares() {
+		std::vector<double> shares;
+		for (auto& slot : slots)
+			shares.push_back(slot.weight);
+		return shares;
+	}
+
+	// Blend factor between the previous split and the throughput measured by the last run
+	void set_adapt_rate(double rate) {
+		adapt_rate = rate;
+	}
+
+	// One copy per device, each counted by that device's memory tracker
+	CL_Multi_Buffer create_buffer(size_t size, cl_mem_flags flags, const std::string& tag = "untagged") {
+		std::vector<cl_mem> buffers;
+		for (auto& slot : slots) {
+			cl_mem buffer = slot.memory_tracker->create_buffer(slot.context, size, flags, tag);
+			if (!buffer)
+				slot.memory_tracker->fail_allocation("OpenCL buffer", size);
+			buffers.push_back(buffer);
+		}
+		return CL_Multi_Buffer(buffers, size);
+	}
+
+	void release_buffer(CL_Multi_Buffer buffer) {
+		for (int i = 0; i < (int)slots.size(); i++) {
+			slots[i].memory_tracker->remove(buffer.buffers[i]);
+			clReleaseMemObject(buffer.buffers[i]);
+		}
+	}
+
+	// Budgets are per device, e.g. get_memory_tracker(i)->set_budget(bytes)
+	std::shared_ptr<CL_Memory_Tracker> get_memory_tracker(int i) { return slots[i].memory_tracker; }
+
+	// Copies the whole host array to every device
+	template <typename T>
+	void write_to_buffer(CL_Multi_Buffer buffer, T* data) {
+		write_to_buffer(buffer, buffer.size, data);
+	}
+
+	template <typename T>
+	void write_to_buffer(CL_Multi_Buffer buffer, size_t size, T* data) {
+		for (int i = 0; i < (int)slots.size(); i++) {
+			cl_int err = clEnqueueWriteBuffer(slots[i].queue, buffer.buffers[i], CL_FALSE, 0, size, data, 0, nullptr, nullptr);
+			assert_cl_success(err, "Error writing to buffer");
+		}
+		finish_queue();
+	}
+
+	template <typename T>
+	CL_Multi_Buffer create_and_write_buffer(size_t size, T* data, cl_mem_flags flags) {
+		CL_Multi_Buffer buffer = create_buffer(size, flags);
+		write_to_buffer(buffer, size, data);
+
+		return buffer;
+	}
+
+	// Gathers the slice each device computed in the last run into one host array.
+	// element_size is the number of bytes the kernel writes per work item.
+	void read_from_buffer(void* data_ptr, CL_Multi_Buffer buffer, size_t element_size) {
+		for (int i = 0; i < (int)slots.size(); i++) {
+			if (slots[i].count == 0)
+				continue;
+			size_t offset = slots[i].offset * element_size;
+			size_t size = slots[i].count * element_size;
+			if (offset + size > buffer.size)
+				size = buffer.size > offset ? buffer.size - offset : 0;
+			cl_int err = clEnqueueReadBuffer(slots[i].queue, buffer.buffers[i], CL_FALSE, offset, size, (char*)data_ptr + offset,
+				0, nullptr, nullptr);
+			assert_cl_success(err, "Error reading from buffer");
+		}
+		finish_queue();
+	}
+
+	void set_kernel_arg(int index, CL_Multi_Buffer buffer) {
+		for (int i = 0; i < (int)slots.size(); i++) {
+			cl_int err = clSetKernelArg(slots[i].kernel, (cl_uint)index, sizeof(cl_mem), &buffer.buffers[i]);
+			assert_cl_success(err, "Error setting OpenCL kernel arg");
+		}
+	}
+
+	void set_kernel_arg(CL_Multi_Buffer buffer) {
+		set_kernel_arg(current_kernel_arg, buffer);
+		current_kernel_arg++;
+	}
+
+	template <typename T>
+	void set_kernel_arg_value(int index, T value) {
+		for (auto& slot : slots) {
+			cl_int err = clSetKernelArg(slot.kernel, (cl_uint)index, sizeof(T), &value);
+			assert_cl_success(err, "Error setting OpenCL kernel arg");
+		}
+	}
+
+	template <typename T>
+	void set_kernel_arg_value(T value) {
+		set_kernel_arg_value(current_kernel_arg, value);
+		current_kernel_arg++;
+	}
+
+	// Splits the NDRange across all devices in work-group sized chunks, each device
+	// receiving a share proportional to its weight. Kernels see their global ids
+	// through the launch offset, so they need no changes to run split.
+	void run_kernel(size_t global_size, size_t local_size) {
+		if (global_size <= 0) {
+			std::cout << "Global item size not initialized!" << "\n";
+			exit(1);
+		}
+		if (local_size <= 0) {
+			std::cout << "Local item size not initialized!" << "\n";
+			exit(1);
+		}
+		if (global_size % local_size != 0) {
+			std::cout << "Global item size must be divisible by local item size!" << "\n\n";
+			exit(1);
+		}
+
+		_split(global_size / local_size, local_size);
+
+		std::vector<cl_event> events(slots.size(), nullptr);
+		for (int i = 0; i < (int)slots.size(); i++) {
+			if (slots[i].count == 0)
+				continue;
+			cl_int err = clEnqueueNDRangeKernel(slots[i].queue, slots[i].kernel, 1, &slots[i].offset, &slots[i].count, &local_size,
+				0, nullptr, &events[i]);
+			assert_cl_success(err, "Error enqueuing OpenCL kernel");
+			clFlush(slots[i].queue);
+		}
+
+		std::vector<double> throughput(slots.size(), 0);
+		double total_throughput = 0;
+		for (int i = 0; i < (int)slots.size(); i++) {
+			if (!events[i])
+				continue;
+			clWaitForEvents(1, &events[i]);
+
+			cl_ulong start = 0, end = 0;
+			clGetEventProfilingInfo(events[i], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, nullptr);
+			clGetEventProfilingInfo(events[i], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, nullptr);
+			clReleaseEvent(events[i]);
+
+			if (end > start) {
+				throughput[i] = (double)slots[i].count / (double)(end - start);
+				total_throughput += throughput[i];
+			}
+		}
+
+		_adapt(throughput, total_throughput);
+	}
+
+	void finish_queue() {
+		for (auto& slot : slots)
+			clFinish(slot.queue);
+		current_kernel_arg = 0;
+	}
+
+private:
+	struct CL_Device_Slot {
+		cl_device_id device_id;
+		cl_context context;
+		cl_command_queue queue;
+		cl_program program;
+		cl_kernel kernel;
+		std::shared_ptr<CL_Memory_Tracker> memory_tracker;
+		double weight;
+		size_t offset;
+		size_t count;
+	};
+
+	std::vector<CL_Device_Slot> slots;
+	double adapt_rate = 0.5;
+	int current_kernel_arg = 0;
+
+	void init(std::vector<cl_device_id> device_ids, const char* filename, const char* function_name) {
+		if (device_ids.size() == 0) {
+			std::cout << "Error! No devices to run on" << "\n";
+			exit(1);
+		}
+
+		std::string s = read_file(filename);
+		const char* program_source = s.c_str();
+		size_t source_length = 0;
+
+		double total_weight = 0;
+		for (auto& id : device_ids) {
+			CL_Device_Slot slot;
+			cl_int err;
+
+			slot.device_id = id;
+			slot.context = clCreateContext(nullptr, 1, &id, nullptr, nullptr, &err);
+			assert_cl_success(err, "Error creating OpenCL context");
+
+			cl_queue_properties props[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
+			slot.queue = clCreateCommandQueueWithProperties(slot.context, id, props, &err);
+			assert_cl_success(err, "Error creating OpenCL command queue");
+
+			slot.program = clCreateProgramWithSource(slot.context, 1, &program_source, &source_length, &err);
+			assert_cl_success(err, "Error creating program");
+			_build_program(slot);
+
+			slot.kernel = clCreateKernel(slot.program, function_name, &err);
+			assert_cl_success(err, "Error creating OpenCL kernel");
+
+			slot.memory_tracker = std::make_shared<CL_Memory_Tracker>("CL_Multi_Util device " + std::to_string(slots.size()));
+
+			// Initial guess at relative speed until a run has been measured
+			cl_uint compute_units = 0, clock_frequency = 0;
+			clGetDeviceInfo(id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &compute_units, nullptr);
+			clGetDeviceInfo(id, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(cl_uint), &clock_frequency, nullptr);
+			slot.weight = (double)compute_units * (double)clock_frequency;
+			if (slot.weight <= 0)
+				slot.weight = 1;
+			total_weight += slot.weight;
+
+			slot.offset = 0;
+			slot.count = 0;
+			slots.push_back(slot);
+		}
+
+		for (auto& slot : slots)
+			slot.weight /= total_weight;
+	}
+
+	void _build_program(CL_Device_Slot& slot) {
+		cl_int err = clBuildProgram(slot.program, 1, &slot.device_id, "", nullptr, nullptr);
+		assert_program_build_success(slot.program, slot.device_id, err);
+	}
+
+	// Every device gets at least one group when there are enough to go round, so a device
+	// whose share has dropped is still measured and can win work back
+	void _split(size_t num_groups, size_t local_size) {
+		size_t minimum = num_groups >= slots.size() ? 1 : 0;
+		size_t spare = num_groups - minimum * slots.size();
+		size_t assigned = 0, spare_assigned = 0;
+		for (int i = 0; i < (int)slots.size(); i++) {
+			size_t extra;
+			if (i == (int)slots.size() - 1)
+				extra = spare - spare_assigned;
+			else
+				extra = std::min(spare - spare_assigned, (size_t)(slots[i].weight * (double)spare + 0.5));
+			size_t groups = minimum + extra;
+
+			slots[i].offset = assigned * local_size;
+			slots[i].count = groups * local_size;
+			assigned += groups;
+			spare_assigned += extra;
+		}
+	}
+
+	void _adapt(const std::vector<double>& throughput, double total_throughput) {
+		if (total_throughput <= 0)
+			return;
+
+		// Devices that sat out keep their old share; the rest is redistributed by throughput
+		double measured_weight = 0;
+		for (int i = 0; i < (int)slots.size(); i++) {
+			if (throughput[i] > 0)
+				measured_weight += slots[i].weight;
+		}
+		for (int i = 0; i < (int)slots.size(); i++) {
+			if (throughput[i] <= 0)
+				continue;
+			double measured_share = measured_weight * throughput[i] / total_throughput;
+			slots[i].weight = (1 - adapt_rate) * slots[i].weight + adapt_rate * measured_share;
+		}
+	}
+};
@@ -0,0 +1,270 @@
+#pragma once
+#include "opencl-util.h"
+#include <iterator>
+
+// Disjoint, merged [begin, end) element ranges
+class CL_Range_Set {
+public:
+	void add(size_t begin, size_t end) {
+		if (begin >= end)
+			return;
+
+		// Absorb every range that touches [begin, end)
+		auto it = ranges.upper_bound(begin);
+		if (it != ranges.begin() && std::prev(it)->second >= begin)
+			it--;
+		while (it != ranges.end() && it->first <= end) {
+			begin = std::min(begin, it->first);
+			end = std::max(end, it->second);
+			it = ranges.erase(it);
+		}
+		ranges[begin] = end;
+	}
+
+	void remove(size_t begin, size_t end) {
+		if (begin >= end)
+			return;
+
+		auto it = ranges.upper_bound(begin);
+		if (it != ranges.begin())
+			it--;
+		while (it != ranges.end() && it->first < end) {
+			size_t range_begin = it->first, range_end = it->second;
+			if (range_end <= begin) {
+				it++;
+				continue;
+			}
+			it = ranges.erase(it);
+			if (range_begin < begin)
+				ranges[range_begin] = begin;
+			if (range_end > end)
+				ranges[end] = range_end;
+		}
+	}
+
+	// Calls fn(begin, end) for the parts of the set inside [begin, end)
+	template <typename F>
+	void for_each(size_t begin, size_t end, F fn) const {
+		auto it = ranges.upper_bound(begin);
+		if (it != ranges.begin())
+			it--;
+		for (; it != ranges.end() && it->first < end; it++) {
+			size_t overlap_begin = std::max(begin, it->first);
+			size_t overlap_end = std::min(end, it->second);
+			if (overlap_begin < overlap_end)
+				fn(overlap_begin, overlap_end);
+		}
+	}
+
+	bool empty() const {
+		return ranges.empty();
+	}
+
+	void clear() {
+		ranges.clear();
+	}
+
+private:
+	std::map<size_t, size_t> ranges;
+};
+
+// A vector with a host copy and a device copy that are synchronized lazily. Each side
+// records which elements it changed, and only those ranges are transferred, only when
+// the other side is accessed. Host writes through operator[] or host_write mark the
+// touched elements; device writes are declared with device_write.
+template <typename T>
+class CL_Vector {
+public:
+	CL_Vector(CL_Util& util, size_t size = 0, cl_mem_flags flags = CL_MEM_READ_WRITE) : util(util), flags(flags) {
+		resize(size);
+	}
+
+	CL_Vector(CL_Util& util, const std::vector<T>& data, cl_mem_flags flags = CL_MEM_READ_WRITE) : util(util), flags(flags) {
+		host = data;
+		count = data.size();
+		_reserve_device(count);
+		host_dirty.add(0, count);
+	}
+
+	~CL_Vector() {
+		util.release_buffer(device);
+	}
+
+	CL_Vector(const CL_Vector&) = delete;
+	CL_Vector& operator=(const CL_Vector&) = delete;
+
+	size_t size() const { return count; }
+	size_t capacity() const { return device_capacity; }
+	bool empty() const { return count == 0; }
+
+	// Grows geometrically so repeated push_back/resize reallocate the device buffer
+	// O(log n) times
+	void reserve(size_t n) {
+		if (n > device_capacity)
+			_reserve_device(std::max(n, device_capacity * 2));
+	}
+
+	void resize(size_t n) {
+		reserve(n);
+		if (n < count) {
+			host_dirty.remove(n, count);
+			device_dirty.remove(n, count);
+		}
+		else if (n > count) {
+			host_dirty.add(count, n);
+		}
+		host.resize(n);
+		count = n;
+	}
+
+	void push_back(const T& value) {
+		resize(count + 1);
+		host[count - 1] = value;
+	}
+
+	void clear() {
+		resize(0);
+	}
+
+	// Host access
+
+	const T* host_read() {
+		_download(0, count);
+		return host.data();
+	}
+
+	const T& host_read(size_t i) {
+		_download(i, i + 1);
+		return host[i];
+	}
+
+	// Pointer to the whole host copy; elements in [begin, end) are marked as changed
+	T* host_write(size_t begin, size_t end) {
+		_download(begin, end);
+		host_dirty.add(begin, end);
+		return host.data();
+	}
+
+	T* host_write() {
+		return host_write(0, count);
+	}
+
+	T& operator[](size_t i) {
+		return host_write(i, i + 1)[i];
+	}
+
+	std::vector<T> to_vector() {
+		host_read();
+		return std::vector<T>(host.begin(), host.begin() + count);
+	}
+
+	// Device access
+
+	// Buffer holding the current data, for kernels that only read it
+	CL_Buffer device_read() {
+		_upload();
+		return CL_Buffer(device, count * sizeof(T));
+	}
+
+	// Buffer for a kernel that writes elements [begin, end)
+	CL_Buffer device_write(size_t begin, size_t end) {
+		_upload();
+		device_dirty.add(begin, end);
+		return CL_Buffer(device, count * sizeof(T));
+	}
+
+	CL_Buffer device_write() {
+		return device_write(0, count);
+	}
+
+	// Bytes moved between host and device so far
+	size_t get_bytes_uploaded() { return bytes_uploaded; }
+	size_t get_bytes_downloaded() { return bytes_downloaded; }
+
+private:
+	CL_Util& util;
+	cl_mem_flags flags;
+
+	std::vector<T> host;
+	size_t count = 0;
+
+	cl_mem device = nullptr;
+	size_t device_capacity = 0;
+
+	CL_Range_Set host_dirty;
+	CL_Range_Set device_dirty;
+
+	size_t bytes_uploaded = 0;
+	size_t bytes_downloaded = 0;
+
+	void _reserve_device(size_t n) {
+		if (n == 0)
+			n = 1;
+		cl_mem new_device = util.create_raw_buffer(n * sizeof(T), flags, "CL_Vector");
+
+		// Elements already in sync are not host-dirty and would never be uploaded again, so
+		// everything moves over; host-dirty ones are overwritten by the next upload anyway
+		if (device) {
+			if (count > 0)
+				_copy_device(device, new_device, 0, count);
+			util.release_buffer(device);
+		}
+
+		device = new_device;
+		device_capacity = n;
+		host.reserve(n);
+	}
+
+	void _copy_device(cl_mem from, cl_mem to, size_t begin, size_t end) {
+		if (util.is_native()) {
+			memcpy((T*)to + begin, (T*)from + begin, (end - begin) * sizeof(T));
+			return;
+		}
+		cl_int err = clEnqueueCopyBuffer(util.get_queue(), from, to, begin * sizeof(T), begin * sizeof(T), (end - begin) * sizeof(T), 0, nullptr, nullptr);
+		assert_cl_success(err, "Error copying OpenCL buffer");
+	}
+
+	void _upload() {
+		if (host_dirty.empty())
+			return;
+
+		host_dirty.for_each(0, count, [&](size_t begin, size_t end) {
+			size_t size = (end - begin) * sizeof(T);
+			if (util.is_native()) {
+				memcpy((T*)device + begin, host.data() + begin, size);
+			}
+			else {
+				cl_int err = clEnqueueWriteBuffer(util.get_queue(), device, CL_FALSE, begin * sizeof(T), size, host.data() + begin, 0, nullptr, nullptr);
+				assert_cl_success(err, "Error writing to buffer");
+			}
+			bytes_uploaded += size;
+		});
+		host_dirty.clear();
+
+		// The host copy must stay untouched until the writes complete
+		if (!util.is_native())
+			clFinish(util.get_queue());
+	}
+
+	void _download(size_t begin, size_t end) {
+		bool any = false;
+		device_dirty.for_each(begin, end, [&](size_t range_begin, size_t range_end) {
+			size_t size = (range_end - range_begin) * sizeof(T);
+			if (util.is_native()) {
+				memcpy(host.data() + range_begin, (T*)device + range_begin, size);
+			}
+			else {
+				cl_int err = clEnqueueReadBuffer(util.get_queue(), device, CL_FALSE, range_begin * sizeof(T), size, host.data() + range_begin, 0, nullptr, nullptr);
+				assert_cl_success(err, "Error reading from buffer");
+			}
+			bytes_downloaded += size;
+			any = true;
+		});
+		if (!any)
+			return;
+
+		device_dirty.remove(begin, end);
+		if (!util.is_native())
+			clFinish(util.get_queue());
+	}
+};
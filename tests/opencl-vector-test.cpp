@@ -0,0 +1,132 @@
+// Checks that CL_Vector keeps host and device copies coherent when the device buffer
+// grows: elements synchronized before a push_back or resize past capacity must still be
+// there for the next kernel, whichever side last wrote them.
+//
+// Build from this directory, e.g.
+//     g++ -std=c++17 -O2 opencl-vector-test.cpp -lOpenCL -pthread -o opencl-vector-test
+// Runs on the device CL_Util picks (PoCL on a CPU-only machine), or on the native backend
+// with CL_UTIL_BACKEND=native. Exits with 1 if any check fails.
+#ifndef CL_TARGET_OPENCL_VERSION
+#define CL_TARGET_OPENCL_VERSION 300
+#endif
+#include <CL/cl.h>
+#include <cstring>
+#include <filesystem>
+#include "../opencl-util.h"
+#include "../opencl-vector.h"
+
+static const char* kernel_source = R"(
+__kernel void vector_double(__global const int* in, __global int* out, const uint n) {
+	uint i = get_global_id(0);
+	if (i < n)
+		out[i] = 2 * in[i];
+}
+)";
+
+static int failures = 0;
+
+static void check(bool condition, const std::string& name) {
+	std::cout << (condition ? "ok      " : "FAILED  ") << name << "\n";
+	if (!condition)
+		failures++;
+}
+
+static void use_double_kernel(CL_Util& util) {
+	if (util.is_native()) {
+		register_native_kernel("vector_double", Native_Kernel::from_range([](size_t begin, size_t end, const Native_Kernel_Args& args) {
+			const int* in = args.buffer<int>(0);
+			int* out = args.buffer<int>(1);
+			cl_uint n = args.value<cl_uint>(2);
+			for (size_t i = begin; i < end && i < n; i++)
+				out[i] = 2 * in[i];
+		}));
+		util.create_kernel("vector_double");
+		return;
+	}
+	std::string path = (std::filesystem::temp_directory_path() / "opencl-vector-test.cl").string();
+	std::ofstream(path) << kernel_source;
+	util.create_program_and_kernel(path.c_str(), "vector_double");
+	std::filesystem::remove(path);
+}
+
+// What a kernel reading the vector's device buffer sees, doubled
+static std::vector<int> run_double(CL_Util& util, CL_Vector<int>& vector) {
+	size_t n = vector.size();
+	CL_Buffer out = util.create_buffer(n * sizeof(int), CL_MEM_READ_WRITE, "test");
+	util.set_kernel_arg(0, vector.device_read());
+	util.set_kernel_arg(1, out);
+	util.set_kernel_arg_value(2, (cl_uint)n);
+	util.run_kernel(n, 1);
+	util.finish_queue();
+
+	std::vector<int> result(n);
+	util.read_from_buffer(result.data(), out);
+	util.release_buffer(out);
+	return result;
+}
+
+static bool is_doubled(const std::vector<int>& result, const std::vector<int>& expected) {
+	if (result.size() != expected.size())
+		return false;
+	for (size_t i = 0; i < result.size(); i++) {
+		if (result[i] != 2 * expected[i])
+			return false;
+	}
+	return true;
+}
+
+int main() {
+	CL_Util util;
+	use_double_kernel(util);
+
+	// Synced by a kernel read, then grown several times by push_back
+	{
+		CL_Vector<int> vector(util);
+		std::vector<int> expected;
+		for (int i = 0; i < 1000; i++) {
+			vector.push_back(i);
+			expected.push_back(i);
+			if (i % 7 == 0)
+				vector.device_read();
+		}
+		check(vector.capacity() >= 1000, "push_back grows the device buffer");
+		check(is_doubled(run_double(util, vector), expected), "push_back growth keeps synced elements for kernels");
+	}
+
+	// Grown by resize right after a full upload, with no host writes in between
+	{
+		CL_Vector<int> vector(util, std::vector<int>{ 1, 2, 3, 4, 5 });
+		vector.device_read();
+		vector.resize(vector.capacity() * 4);
+		std::vector<int> expected(vector.size(), 0);
+		for (int i = 0; i < 5; i++)
+			expected[i] = i + 1;
+		check(is_doubled(run_double(util, vector), expected), "resize growth keeps synced elements for kernels");
+	}
+
+	// Written by a kernel, then grown before the host looks at it
+	{
+		CL_Vector<int> source(util, std::vector<int>{ 10, 20, 30 });
+		CL_Vector<int> vector(util, 3);
+		util.set_kernel_arg(0, source.device_read());
+		util.set_kernel_arg(1, vector.device_write());
+		util.set_kernel_arg_value(2, (cl_uint)3);
+		util.run_kernel(3, 1);
+		util.finish_queue();
+
+		for (int i = 0; i < 100; i++)
+			vector.push_back(i);
+		std::vector<int> expected = { 20, 40, 60 };
+		for (int i = 0; i < 100; i++)
+			expected.push_back(i);
+		check(vector.to_vector() == expected, "growth keeps device-written elements for the host");
+		check(is_doubled(run_double(util, vector), expected), "growth keeps device-written elements for kernels");
+	}
+
+	if (failures) {
+		std::cout << failures << " check(s) failed" << "\n";
+		return 1;
+	}
+	std::cout << "All checks passed" << "\n";
+	return 0;
+}
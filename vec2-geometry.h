@@ -0,0 +1,408 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include "vec2.h"
+#include "native-util.h"
+
+// Batched geometry over arrays of Vec2 for collision and region passes: point in polygon,
+// segment intersection, polygon area and centroid, and convex hull.
+//
+// The inner loops have no branches, so the compiler vectorizes them, and large batches are
+// split over Native_Thread_Pool::shared(). Orientation tests are exact: a floating-point
+// test with an error bound decides almost every case, and the few it cannot are settled
+// with exact arithmetic afterwards, so results never depend on rounding. That relies on
+// strict IEEE double arithmetic, so do not build this with -ffast-math.
+class Vec2_Geometry {
+public:
+	struct Segment {
+		Vec2 a, b;
+	};
+
+	// Turn a -> b -> c: 1 counterclockwise (c left of a->b), -1 clockwise, 0 collinear
+	static int orient2d(const Vec2& a, const Vec2& b, const Vec2& c) {
+		double det, bound;
+		_orient_fast(a.x, a.y, b.x, b.y, c.x, c.y, det, bound);
+		if (det > bound)
+			return 1;
+		if (det < -bound)
+			return -1;
+		return _orient_exact(a, b, c);
+	}
+
+	// orient2d(a, b, points[i]) for every point
+	static void orient2d(const Vec2& a, const Vec2& b, const Vec2* points, size_t count, signed char* signs) {
+		_for_ranges(count, 1, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				double det, bound;
+				_orient_fast(a.x, a.y, b.x, b.y, points[i].x, points[i].y, det, bound);
+				signs[i] = (signed char)((det > bound) - (det < -bound));
+			}
+			// Only points within rounding error of the line are left at 0
+			for (size_t i = begin; i < end; i++) {
+				if (signs[i] == 0)
+					signs[i] = (signed char)_orient_exact(a, b, points[i]);
+			}
+		});
+	}
+
+	// Winding number of each point around the polygon (n vertices in order, closed back to
+	// the first). Points exactly on an edge get the winding number of one of its sides.
+	static void winding_numbers(const Vec2* polygon, size_t n, const Vec2* points, size_t count, int* winding) {
+		_for_ranges(count, n, [&](size_t begin, size_t end) {
+			for (size_t block = begin; block < end; block += block_size)
+				_winding_block(polygon, n, points + block, std::min(block_size, end - block), winding + block);
+		});
+	}
+
+	// Nonzero rule, so self-intersecting polygons and either vertex order work
+	static void points_in_polygon(const Vec2* polygon, size_t n, const Vec2* points, size_t count, unsigned char* inside) {
+		std::vector<int> winding(count);
+		winding_numbers(polygon, n, points, count, winding.data());
+		for (size_t i = 0; i < count; i++)
+			inside[i] = winding[i] != 0;
+	}
+
+	// hits[i] = whether s[i] and t[i] share a point. Touching ends and overlapping
+	// collinear segments count.
+	static void segments_intersect(const Segment* s, const Segment* t, size_t count, unsigned char* hits) {
+		_for_ranges(count, 1, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+				hits[i] = _intersect_fast(s[i], t[i]);
+			for (size_t i = begin; i < end; i++) {
+				if (hits[i] == unsure)
+					hits[i] = _intersect_exact(s[i], t[i]);
+			}
+		});
+	}
+
+	// Every intersecting pair (i, j) of s[i] and t[j], sorted
+	static std::vector<std::pair<size_t, size_t>> segment_intersections(const Segment* s, size_t ns, const Segment* t, size_t nt) {
+		std::vector<std::pair<size_t, size_t>> pairs;
+		std::mutex mutex;
+		_for_ranges(ns, nt, [&](size_t begin, size_t end) {
+			std::vector<unsigned char> hits(nt);
+			std::vector<std::pair<size_t, size_t>> found;
+			for (size_t i = begin; i < end; i++) {
+				Segment segment = s[i];
+				for (size_t j = 0; j < nt; j++)
+					hits[j] = _intersect_fast(segment, t[j]);
+				for (size_t j = 0; j < nt; j++) {
+					if (hits[j] == unsure)
+						hits[j] = _intersect_exact(segment, t[j]);
+					if (hits[j])
+						found.push_back(std::make_pair(i, j));
+				}
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			pairs.insert(pairs.end(), found.begin(), found.end());
+		});
+		std::sort(pairs.begin(), pairs.end());
+		return pairs;
+	}
+
+	// Signed area, positive for counterclockwise vertex order
+	static double polygon_area(const Vec2* polygon, size_t n) {
+		return 0.5 * _shoelace(polygon, n).area2;
+	}
+
+	// Centroid of the enclosed area; the vertex average for polygons with no area
+	static Vec2 polygon_centroid(const Vec2* polygon, size_t n) {
+		return _shoelace(polygon, n).centroid(polygon, n);
+	}
+
+	// Many small polygons at once: polygon k has vertices [offsets[k], offsets[k + 1])
+	static void polygon_areas(const Vec2* vertices, const size_t* offsets, size_t num_polygons, double* areas) {
+		_for_ranges(num_polygons, 16, [&](size_t begin, size_t end) {
+			for (size_t k = begin; k < end; k++)
+				areas[k] = polygon_area(vertices + offsets[k], offsets[k + 1] - offsets[k]);
+		});
+	}
+
+	static void polygon_centroids(const Vec2* vertices, const size_t* offsets, size_t num_polygons, Vec2* centroids) {
+		_for_ranges(num_polygons, 16, [&](size_t begin, size_t end) {
+			for (size_t k = begin; k < end; k++)
+				centroids[k] = polygon_centroid(vertices + offsets[k], offsets[k + 1] - offsets[k]);
+		});
+	}
+
+	// Counterclockwise hull from the lowest x (then lowest y) point, without collinear
+	// points. A batched pass first drops every point inside the quadrilateral of the four
+	// extreme points, so only the few that can be on the hull are sorted.
+	static std::vector<Vec2> convex_hull(const Vec2* points, size_t count) {
+		if (count == 0)
+			return {};
+
+		size_t left = 0, right = 0, bottom = 0, top = 0;
+		for (size_t i = 1; i < count; i++) {
+			if (points[i].x < points[left].x)
+				left = i;
+			if (points[i].x > points[right].x)
+				right = i;
+			if (points[i].y < points[bottom].y)
+				bottom = i;
+			if (points[i].y > points[top].y)
+				top = i;
+		}
+		// Counterclockwise, so strictly inside means strictly left of every edge
+		Vec2 quad[5] = { points[left], points[bottom], points[right], points[top], points[left] };
+
+		std::vector<unsigned char> inside(count);
+		_for_ranges(count, 4, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				int strictly_inside = 1;
+				for (int k = 0; k < 4; k++) {
+					double det, bound;
+					_orient_fast(quad[k].x, quad[k].y, quad[k + 1].x, quad[k + 1].y, points[i].x, points[i].y, det, bound);
+					strictly_inside &= det > bound;
+				}
+				inside[i] = (unsigned char)strictly_inside;
+			}
+		});
+
+		std::vector<Vec2> candidates;
+		for (size_t i = 0; i < count; i++) {
+			if (!inside[i])
+				candidates.push_back(points[i]);
+		}
+		std::sort(candidates.begin(), candidates.end(), [](const Vec2& p, const Vec2& q) {
+			return p.x < q.x || (p.x == q.x && p.y < q.y);
+		});
+		candidates.erase(std::unique(candidates.begin(), candidates.end(), [](const Vec2& p, const Vec2& q) {
+			return p.x == q.x && p.y == q.y;
+		}), candidates.end());
+		if (candidates.size() < 3)
+			return candidates;
+
+		// Monotone chain: lower hull left to right, then upper hull back
+		std::vector<Vec2> hull(2 * candidates.size());
+		size_t k = 0;
+		for (size_t i = 0; i < candidates.size(); i++) {
+			while (k >= 2 && orient2d(hull[k - 2], hull[k - 1], candidates[i]) <= 0)
+				k--;
+			hull[k++] = candidates[i];
+		}
+		for (size_t i = candidates.size() - 1, lower = k + 1; i > 0; i--) {
+			while (k >= lower && orient2d(hull[k - 2], hull[k - 1], candidates[i - 1]) <= 0)
+				k--;
+			hull[k++] = candidates[i - 1];
+		}
+		hull.resize(k - 1);
+		return hull;
+	}
+
+private:
+	static constexpr size_t block_size = 256;
+	static constexpr unsigned char unsure = 2;
+
+	// Batches below this many element-edge steps run on the calling thread
+	static constexpr size_t parallel_work = 1 << 16;
+
+	// Shewchuk's bound for the floating-point orientation: a result larger than this in
+	// magnitude has the right sign. 2^-53 is the unit roundoff of double.
+	static constexpr double epsilon = 1.1102230246251565e-16;
+	static constexpr double orient_bound = (3.0 + 16.0 * epsilon) * epsilon;
+
+	struct Shoelace {
+		double area2 = 0;
+		double cx = 0;
+		double cy = 0;
+
+		Vec2 centroid(const Vec2* polygon, size_t n) {
+			if (area2 != 0)
+				return Vec2((float)(polygon[0].x + cx / (3 * area2)), (float)(polygon[0].y + cy / (3 * area2)));
+			double x = 0, y = 0;
+			for (size_t i = 0; i < n; i++) {
+				x += polygon[i].x;
+				y += polygon[i].y;
+			}
+			return n ? Vec2((float)(x / (double)n), (float)(y / (double)n)) : Vec2();
+		}
+	};
+
+	// Calls fn(begin, end) over [0, count), split over the shared pool once the batch is
+	// large enough to pay for it
+	static void _for_ranges(size_t count, size_t work_per_item, const std::function<void(size_t, size_t)>& fn) {
+		work_per_item = std::max(work_per_item, (size_t)1);
+		if (count == 0)
+			return;
+		if (count * work_per_item < parallel_work) {
+			fn(0, count);
+			return;
+		}
+		size_t grain = std::max(block_size * 16 / work_per_item, (size_t)1);
+		Native_Thread_Pool::shared().parallel_for(count, grain, fn);
+	}
+
+	static inline void _orient_fast(double ax, double ay, double bx, double by, double cx, double cy, double& det, double& bound) {
+		double left = (ax - cx) * (by - cy);
+		double right = (ay - cy) * (bx - cx);
+		det = left - right;
+		bound = orient_bound * (std::abs(left) + std::abs(right));
+	}
+
+	// s = a + b exactly as the rounded sum plus the rounding error
+	static inline void _two_sum(double a, double b, double& sum, double& error) {
+		sum = a + b;
+		double b_virtual = sum - a;
+		double a_virtual = sum - b_virtual;
+		error = (a - a_virtual) + (b - b_virtual);
+	}
+
+	// The product of two floats is exact in double, so the determinant is a sum of six exact
+	// terms. They are added into an expansion (a sum of non-overlapping doubles of growing
+	// magnitude) without any rounding, and its sign is that of the largest component.
+	static int _orient_exact(const Vec2& a, const Vec2& b, const Vec2& c) {
+		double terms[6] = {
+			(double)a.x * b.y, -((double)a.y * b.x),
+			(double)b.x * c.y, -((double)b.y * c.x),
+			(double)c.x * a.y, -((double)c.y * a.x)
+		};
+
+		double expansion[6];
+		int length = 0;
+		for (double term : terms) {
+			double q = term;
+			int next = 0;
+			for (int i = 0; i < length; i++) {
+				double sum, error;
+				_two_sum(q, expansion[i], sum, error);
+				if (error != 0)
+					expansion[next++] = error;
+				q = sum;
+			}
+			expansion[next++] = q;
+			length = next;
+		}
+
+		for (int i = length - 1; i >= 0; i--) {
+			if (expansion[i] != 0)
+				return expansion[i] > 0 ? 1 : -1;
+		}
+		return 0;
+	}
+
+	// Points are copied to double arrays once per block so every edge runs a contiguous,
+	// vectorizable loop over them. An upward edge with the point on its left adds one, a
+	// downward edge with the point on its right subtracts one. Points too close to an edge
+	// for the fast orientation are redone exactly.
+	static void _winding_block(const Vec2* polygon, size_t n, const Vec2* points, size_t count, int* winding) {
+		double px[block_size], py[block_size];
+		unsigned char close[block_size];
+		for (size_t i = 0; i < count; i++) {
+			px[i] = points[i].x;
+			py[i] = points[i].y;
+			winding[i] = 0;
+			close[i] = 0;
+		}
+
+		for (size_t e = 0; e < n; e++) {
+			const Vec2& v0 = polygon[e];
+			const Vec2& v1 = polygon[e + 1 == n ? 0 : e + 1];
+			double x0 = v0.x, y0 = v0.y, x1 = v1.x, y1 = v1.y;
+			for (size_t i = 0; i < count; i++) {
+				double det, bound;
+				_orient_fast(x0, y0, x1, y1, px[i], py[i], det, bound);
+				int up = (y0 <= py[i]) & (y1 > py[i]);
+				int down = (y1 <= py[i]) & (y0 > py[i]);
+				int ccw = det > bound;
+				int cw = det < -bound;
+				winding[i] += (up & ccw) - (down & cw);
+				close[i] |= (unsigned char)((up | down) & !(ccw | cw));
+			}
+		}
+
+		for (size_t i = 0; i < count; i++) {
+			if (close[i])
+				winding[i] = _winding_exact(polygon, n, points[i]);
+		}
+	}
+
+	static int _winding_exact(const Vec2* polygon, size_t n, const Vec2& point) {
+		int winding = 0;
+		for (size_t e = 0; e < n; e++) {
+			const Vec2& v0 = polygon[e];
+			const Vec2& v1 = polygon[e + 1 == n ? 0 : e + 1];
+			if (v0.y <= point.y && v1.y > point.y && orient2d(v0, v1, point) > 0)
+				winding++;
+			else if (v1.y <= point.y && v0.y > point.y && orient2d(v0, v1, point) < 0)
+				winding--;
+		}
+		return winding;
+	}
+
+	static inline int _bounding_boxes_overlap(const Segment& s, const Segment& t) {
+		return (std::min(s.a.x, s.b.x) <= std::max(t.a.x, t.b.x)) & (std::min(t.a.x, t.b.x) <= std::max(s.a.x, s.b.x))
+			& (std::min(s.a.y, s.b.y) <= std::max(t.a.y, t.b.y)) & (std::min(t.a.y, t.b.y) <= std::max(s.a.y, s.b.y));
+	}
+
+	// Sign of the fast orientation, or 0 when it is too close to call
+	static inline int _orient_sign_fast(const Vec2& a, const Vec2& b, const Vec2& c) {
+		double det, bound;
+		_orient_fast(a.x, a.y, b.x, b.y, c.x, c.y, det, bound);
+		return (det > bound) - (det < -bound);
+	}
+
+	// 1 hit, 0 miss, or unsure when an orientation that matters was too close to call
+	static inline unsigned char _intersect_fast(const Segment& s, const Segment& t) {
+		int o1 = _orient_sign_fast(s.a, s.b, t.a);
+		int o2 = _orient_sign_fast(s.a, s.b, t.b);
+		int o3 = _orient_sign_fast(t.a, t.b, s.a);
+		int o4 = _orient_sign_fast(t.a, t.b, s.b);
+		int overlap = _bounding_boxes_overlap(s, t);
+
+		int hit = overlap & (o1 * o2 < 0) & (o3 * o4 < 0);
+		int miss = !overlap | (o1 * o2 > 0) | (o3 * o4 > 0);
+		return (unsigned char)(hit | ((!hit & !miss) << 1));
+	}
+
+	// Each segment's ends straddle or touch the other's line; for collinear segments the
+	// bounding boxes decide
+	static unsigned char _intersect_exact(const Segment& s, const Segment& t) {
+		int o1 = orient2d(s.a, s.b, t.a);
+		int o2 = orient2d(s.a, s.b, t.b);
+		int o3 = orient2d(t.a, t.b, s.a);
+		int o4 = orient2d(t.a, t.b, s.b);
+		return (unsigned char)(_bounding_boxes_overlap(s, t) && o1 * o2 <= 0 && o3 * o4 <= 0);
+	}
+
+	// Twice the signed area and the centroid moments, relative to the first vertex so large
+	// coordinates do not cancel. Four partial sums let the loop vectorize without
+	// reassociating a single sum.
+	static Shoelace _shoelace(const Vec2* polygon, size_t n) {
+		Shoelace result;
+		if (n < 3)
+			return result;
+
+		double ox = polygon[0].x, oy = polygon[0].y;
+		double area2[4] = {}, cx[4] = {}, cy[4] = {};
+		size_t edges = n - 1;
+		size_t i = 0;
+		for (; i + 4 <= edges; i += 4) {
+			for (int k = 0; k < 4; k++) {
+				double x0 = polygon[i + k].x - ox, y0 = polygon[i + k].y - oy;
+				double x1 = polygon[i + k + 1].x - ox, y1 = polygon[i + k + 1].y - oy;
+				double cross = x0 * y1 - x1 * y0;
+				area2[k] += cross;
+				cx[k] += (x0 + x1) * cross;
+				cy[k] += (y0 + y1) * cross;
+			}
+		}
+		// The remaining edges, including the closing edge back to the first vertex
+		for (; i < n; i++) {
+			const Vec2& next = polygon[i + 1 == n ? 0 : i + 1];
+			double x0 = polygon[i].x - ox, y0 = polygon[i].y - oy;
+			double x1 = next.x - ox, y1 = next.y - oy;
+			double cross = x0 * y1 - x1 * y0;
+			area2[0] += cross;
+			cx[0] += (x0 + x1) * cross;
+			cy[0] += (y0 + y1) * cross;
+		}
+
+		result.area2 = (area2[0] + area2[1]) + (area2[2] + area2[3]);
+		result.cx = (cx[0] + cx[1]) + (cx[2] + cx[3]);
+		result.cy = (cy[0] + cy[1]) + (cy[2] + cy[3]);
+		return result;
+	}
+};